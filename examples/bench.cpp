@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <http_parser.h>
 #include <cstring>
+#include <cstdlib>
+#include <cstdio>
 #include <signal.h>
 
 using namespace whs;
@@ -28,6 +30,7 @@ class TestMiddleware : public Middleware
         const char ret[] = "Hello World.";
         resp.setBody(dup_memory(ret, sizeof(ret)), sizeof(ret));
         resp.addHeader(utils::CommonHeader::ContentType, "text/plain");
+        resp.status(HTTP_STATUS_OK);
         return true;
     };
 };
@@ -50,15 +53,34 @@ void setup_sig(int sig, sigfunc func)
 
 whs::LibuvWhs *w = nullptr;
 
-int main()
+// usage: bench [workers]
+//   workers: event loop count, default 1. 0 means one per CPU.
+int main(int argc, char *argv[])
 {
     route::HttpRouteBuilder builder;
 
     builder.use<HTTP_GET, TestMiddleware>("/bench");
 
     w = new LibuvWhs("0.0.0.0", 12345u);
+    if (argc > 1) {
+        w->setWorkerCount(static_cast<unsigned int>(atoi(argv[1])));
+    }
     w->setup(nullptr, &builder, nullptr);
     setup_sig(SIGINT, parent_sigint);
     w->start();
+
+    auto st = w->getReadBufferStats();
+    printf("read buffers: malloc %zu, pool hit %zu, free %zu, in use %zu\n",
+           st.mallocs,
+           st.hits,
+           st.frees,
+           st.inUse);
+    auto cs = w->getConnectionPoolStats();
+    printf("connections: growth %zu, pool hit %zu, free %zu, in use %zu, trim %zu\n",
+           cs.growths,
+           cs.hits,
+           cs.frees,
+           cs.inUse,
+           cs.trims);
     delete w;
 }
\ No newline at end of file
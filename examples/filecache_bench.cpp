@@ -0,0 +1,71 @@
+#include "whs-internal.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace whs;
+using namespace std;
+
+static constexpr uint64_t files = 64;
+
+// `threads' workers hitting the cached files, as the event loops do for small static files.
+// `serialize' takes one mutex around every lookup, as the cache did before
+static void run(utils::FileCache &cache, unsigned threads, size_t lookups, bool serialize)
+{
+    mutex m;
+    vector<thread> workers;
+    auto begin = chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&cache, &m, t, lookups, serialize] {
+            for (size_t i = 0; i < lookups; ++i) {
+                uint64_t key = (i * 7919 + t) % files + 1;
+                utils::FileCache::Entry *e;
+                if (serialize) {
+                    lock_guard<mutex> guard(m);
+                    e = cache.get(key);
+                } else {
+                    e = cache.get(key);
+                }
+                utils::FileCache::release(e);
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin);
+    printf("%-8s %2u threads %7.1f M hits/s\n", serialize ? "mutex" : "snapshot", threads,
+           static_cast<double>(threads * lookups) * 1e3 / ns.count());
+}
+
+// usage: filecache_bench [max threads] [lookups per thread]
+int main(int argc, char *argv[])
+{
+    unsigned maxThreads = argc > 1 ? strtoul(argv[1], nullptr, 10)
+                                   : max(1u, thread::hardware_concurrency());
+    size_t lookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : 2000000;
+
+    char name[] = "/tmp/filecache_bench-XXXXXX";
+    int fd = mkstemp(name);
+    unlink(name);
+    vector<char> body(4096, 'x');
+    if (fd < 0 || write(fd, body.data(), body.size()) != static_cast<ssize_t>(body.size())) {
+        perror("filecache_bench");
+        return 1;
+    }
+    utils::FileCache cache;
+    for (uint64_t key = 1; key <= files; ++key) {
+        utils::FileCache::release(cache.put(key, "", fd, body.size(), cache.currentEpoch()));
+    }
+    close(fd);
+
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        run(cache, threads, lookups, true);
+        run(cache, threads, lookups, false);
+    }
+}
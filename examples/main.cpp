@@ -83,6 +83,7 @@ int main()
 
     whs.setup(&a, &builder, &b);
     whs.enable_static_file("/", "/tmp/html");
+    whs.setStaticFileEtagIndex("/tmp/whsfsd-etags");
     pthread_t th;
 
     pthread_create(&th, nullptr, run, &whs);
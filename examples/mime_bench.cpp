@@ -0,0 +1,62 @@
+#include "mime.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace whs;
+using namespace std;
+
+// the lookup the static file server did before: strcmp along the table
+static string_view linear(const char *ext)
+{
+    for (const auto &e : mime::builtin) {
+        // the builtin extensions are literals, so terminated
+        if (strcmp(e.extension.data(), ext) == 0) {
+            return e.type;
+        }
+    }
+    return mime::default_type;
+}
+
+template <class F>
+static void run(const char *name, const vector<string> &exts, size_t lookups, F find)
+{
+    size_t bytes = 0;
+    auto begin = chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        bytes += find(exts[(i * 7919) % exts.size()]).size();
+    }
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin);
+    printf("%-14s %6.1f ns/lookup (%zu)\n", name, static_cast<double>(ns.count()) / lookups, bytes);
+}
+
+// usage: mime_bench [lookups]
+int main(int argc, char *argv[])
+{
+    size_t lookups = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000000;
+    // every builtin extension, weighted towards the usual web ones, and some misses
+    vector<string> exts, names;
+    for (const auto &e : mime::builtin) {
+        exts.emplace_back(e.extension);
+    }
+    for (int i = 0; i < 8; ++i) {
+        for (auto ext : {"html", "css", "js", "png", "jpg", "svg", "woff2", "json"}) {
+            exts.emplace_back(ext);
+        }
+    }
+    for (auto ext : {"map", "md", "tar", "csv", "yaml"}) {
+        exts.emplace_back(ext);
+    }
+    for (const auto &ext : exts) {
+        names.push_back("assets/app." + ext);
+    }
+
+    mime::Table types;
+    run("linear", exts, lookups, [](const string &ext) { return linear(ext.c_str()); });
+    run("perfect hash", exts, lookups, [](const string &ext) { return mime::find(ext); });
+    run("table", names, lookups, [&types](const string &name) { return types.type_of(name); });
+}
@@ -0,0 +1,66 @@
+#include "whs/whs.h"
+#include "whs/builder.h"
+#include "whs/entity.h"
+#include "whs/pipeline.h"
+#include "whs-internal.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace whs;
+using namespace std;
+
+// a small stage, as a header check or a counter would be
+template <int N>
+class Stage : public Middleware
+{
+public:
+    virtual bool operator()(Request &, Response &resp) const THROWS override
+    {
+        resp.status(resp.status() + N);
+        return true;
+    }
+};
+
+template <class... M>
+static void dynamic(PipelineBuilder &b)
+{
+    (b.addMiddleware<M>(), ...);
+}
+
+static void run(const char *name, PipelineBuilder &b, size_t requests)
+{
+    Pipeline pipe(b);
+    Request req;
+    Response resp;
+    long sum = 0;
+    auto begin = chrono::steady_clock::now();
+    for (size_t i = 0; i < requests; ++i) {
+        resp.status(0);
+        size_t next = 0;
+        pipe.feed(req, resp, next);
+        sum += resp.status();
+    }
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin);
+    printf("%-8s %6.2f ns/request (%ld)\n", name, static_cast<double>(ns.count()) / requests, sum);
+}
+
+// usage: pipeline_bench [requests]
+int main(int argc, char *argv[])
+{
+    size_t requests = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000000;
+    PipelineBuilder empty;
+    run("empty", empty, requests);
+
+    // 10 stages, through Middleware pointers
+    PipelineBuilder pointers;
+    dynamic<Stage<1>, Stage<2>, Stage<3>, Stage<4>, Stage<5>, Stage<6>, Stage<7>, Stage<8>,
+            Stage<9>, Stage<10>>(pointers);
+    run("dynamic", pointers, requests);
+
+    // the same stages, fused
+    PipelineBuilder fused(new StaticPipeline<Stage<1>, Stage<2>, Stage<3>, Stage<4>, Stage<5>,
+                                             Stage<6>, Stage<7>, Stage<8>, Stage<9>, Stage<10>>);
+    run("static", fused, requests);
+}
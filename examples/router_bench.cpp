@@ -0,0 +1,98 @@
+#include "whs/whs.h"
+#include "whs/builder.h"
+#include "whs/entity.h"
+#include "whs-internal.h"
+
+#include <http_parser.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace whs;
+using namespace std;
+using whs::route::HttpRouteBuilder;
+using whs::route::RadixTree;
+
+class Nop : public Middleware
+{
+    virtual bool operator()(RestfulHttpRequest &, RestfulHttpResponse &) const THROWS override
+    {
+        return true;
+    }
+};
+
+// route `i' and an URL matching it. Static, unconstrained and constrained params are mixed,
+// and routes share prefixes in groups of 16 so that nodes get some fanout.
+static void makeRoute(size_t i, string &route, string &url)
+{
+    auto group = to_string(i / 16);
+    auto id = to_string(i);
+    switch (i % 4) {
+        case 0:
+            route = "/api/g" + group + "/static" + id + "/list";
+            url = route;
+            break;
+        case 1:
+            route = "/api/g" + group + "/user" + id + "/{name}";
+            url = "/api/g" + group + "/user" + id + "/alice";
+            break;
+        case 2:
+            route = "/api/g" + group + "/item" + id + "/{id:[0-9]+}/detail";
+            url = "/api/g" + group + "/item" + id + "/4711/detail";
+            break;
+        default:
+            route = "/files/g" + group + "/d" + id + "/{dir}/{file}";
+            url = "/files/g" + group + "/d" + id + "/img/logo.png";
+            break;
+    }
+}
+
+static void run(size_t routes, size_t lookups)
+{
+    HttpRouteBuilder builder;
+    vector<string> urls;
+    string route, url;
+    for (size_t i = 0; i < routes; ++i) {
+        makeRoute(i, route, url);
+        builder.use<HTTP_GET, Nop>(route);
+        urls.push_back(url);
+        // one miss for every 8 hits: right prefix, wrong tail
+        if (i % 8 == 0) {
+            urls.push_back(url + "/missing");
+        }
+    }
+    unique_ptr<RadixTree> tree(builder.build());
+    // the router owns the handlers
+    route::HttpRouter router(std::move(builder));
+
+    RadixTree::ParamList params;
+    size_t count, hits = 0, paramCount = 0;
+    auto begin = chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        const auto &u = urls[(i * 7919) % urls.size()];
+        if (tree->find(u, HTTP_GET, params, count) != nullptr) {
+            ++hits;
+            paramCount += count;
+        }
+    }
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin);
+
+    printf("%6zu routes %6zu nodes: %7.1f ns/lookup, %zu/%zu hit, %zu params\n",
+           routes,
+           tree->size(),
+           static_cast<double>(ns.count()) / lookups,
+           hits,
+           lookups,
+           paramCount);
+}
+
+// usage: router_bench [lookups]
+int main(int argc, char *argv[])
+{
+    size_t lookups = argc > 1 ? strtoul(argv[1], nullptr, 10) : 2000000;
+    run(1000, lookups);
+    run(10000, lookups);
+}
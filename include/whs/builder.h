@@ -52,8 +52,7 @@ namespace whs
 
     namespace route
     {
-        struct HttpRouteNode;
-        struct HttpRouteRootNode;
+        class RadixTree;
 
         class HttpRouteBuilder
         {
@@ -93,6 +92,20 @@ namespace whs
             std::vector<Middleware *> middles;
             std::vector<TreeNode *> endNodes;
 
+            // route `Method' to `path' to `ware', named `name' (malloc'ed)
+            reference add(int Method, const std::string &path, Middleware *ware, const char *name)
+            {
+                std::vector<std::string> paths;
+                middles.emplace_back(ware);
+                utils::splitURL(paths, path);
+
+                insertChild(Method, root, paths.cbegin(), paths.cend(), ware, name);
+                return *this;
+            }
+
+            // `ware' running on the offload threads, owning it
+            static Middleware *offloaded(Middleware *ware);
+
         public:
             auto begin() const
             {
@@ -108,18 +121,10 @@ namespace whs
             auto use(int Method, const std::string &path, Args &&... args)
                 -> EnableIfMiddleType<Middle, reference>
             {
-                std::vector<std::string> paths;
-                Middleware *ware = new Middle(std::forward<Args>(args)...);
-                middles.emplace_back(ware);
-                utils::splitURL(paths, path);
-
-                insertChild(Method,
-                            root,
-                            paths.cbegin(),
-                            paths.cend(),
-                            ware,
-                            utils::demangle(typeid(Middle).name()));
-                return *this;
+                return add(Method,
+                           path,
+                           new Middle(std::forward<Args>(args)...),
+                           utils::demangle(typeid(Middle).name()));
             }
 
             template <int Method, class Middle, class... Args>
@@ -129,34 +134,74 @@ namespace whs
                 return use<Middle>(Method, path, std::forward<Args>(args)...);
             }
 
+            /**
+             * @brief as use(), for handlers keeping the CPU busy (rendering, encoding): the
+             * handler runs on the offload threads (see Whs::setOffloadThreads), so that the event
+             * loop goes on meanwhile. The request is suspended until it returns, later requests
+             * of the connection wait. Without an event loop, the handler runs right away.
+             */
+            template <class Middle, class... Args>
+            auto offload(int Method, const std::string &path, Args &&... args)
+                -> EnableIfMiddleType<Middle, reference>
+            {
+                return add(Method,
+                           path,
+                           offloaded(new Middle(std::forward<Args>(args)...)),
+                           utils::demangle(typeid(Middle).name()));
+            }
+
+            template <int Method, class Middle, class... Args>
+            auto offload(const std::string &path, Args &&... args)
+                -> EnableIfMiddleType<Middle, reference>
+            {
+                return offload<Middle>(Method, path, std::forward<Args>(args)...);
+            }
+
             reference withURLPrefix(const std::string &);
 
             ~HttpRouteBuilder();
 
             HttpRouteBuilder();
 
-            HttpRouteRootNode *build();
+            RadixTree *build();
 
             int endNodesCount() const
             {
                 return static_cast<int>(endNodes.size());
             }
-
-            static void buildTreeNode(TreeNode *bnode, HttpRouteNode *rnode);
         };
 
     }  // namespace route
 
+    /**
+     * @brief StaticStages: what a Pipeline sees of a StaticPipeline (whs/pipeline.h)
+     */
+    class StaticStages
+    {
+    public:
+        virtual ~StaticStages() {}
+
+        virtual size_t size() const = 0;
+
+        // run the stages from `next' on. false if one suspended the request, `next' is then the
+        // one after it
+        virtual bool feed(Request &, Response &, size_t &next) const THROWS = 0;
+    };
+
     class PipelineBuilder final
     {
         friend class Pipeline;
 
         using itor = std::pair<std::string, Middleware *>;
         std::vector<std::pair<std::string, Middleware *>> _wares;
+        StaticStages *_fused = nullptr;
 
     public:
         PipelineBuilder() {}
 
+        // the pipeline runs `fused', which it takes, before the middlewares added
+        explicit PipelineBuilder(StaticStages *fused) : _fused(fused) {}
+
         void addMiddleware(Middleware *p)
         {
             auto name = utils::demangle(typeid(*p).name());
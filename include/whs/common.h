@@ -12,6 +12,8 @@ struct uv_stream_s;
 
 #include <whs/whs_config.h>
 
+#include <cstddef>
+
 #ifdef __GNUG__
 #include <cxxabi.h>
 #define WHS_HAVE_GNUG_CXX_ABI
@@ -97,6 +99,54 @@ namespace whs
 
     class TcpWhs;
 
+    /**
+     * @brief counters of a buffer pool. mallocs only grows when the pool has no free slab.
+     *
+     */
+    struct BufferPoolStats {
+        size_t mallocs;  // slabs allocated from the heap
+        size_t hits;     // slabs served from the free lists
+        size_t frees;    // slabs returned to the heap (free list full)
+        size_t inUse;    // slabs currently held by reads
+    };
+
+    /**
+     * @brief counters of the connection pools of the event loops (see
+     * LibuvWhs::setConnectionPoolSize).
+     *
+     */
+    struct ConnectionPoolStats {
+        size_t growths;  // connections allocated from the heap, the pool being empty
+        size_t hits;     // connections served from the pool
+        size_t frees;    // connections returned to the heap (pool full)
+        size_t inUse;    // connections currently open
+        size_t trims;    // pooled connections whose buffers, grown by a large message, were freed
+    };
+
+    /**
+     * @brief counters of the static file cache.
+     *
+     */
+    struct FileCacheStats {
+        size_t hits;           // responses served from memory
+        size_t misses;         // lookups of files not in the cache
+        size_t evictions;      // entries dropped to stay within the budget
+        size_t invalidations;  // entries dropped because the file changed
+        size_t entries;        // files currently cached
+        size_t bytes;          // body bytes currently cached
+    };
+
+    /**
+     * @brief counters of deferred responses (see Deferred), summed over the event loops.
+     *
+     */
+    struct DeferredStats {
+        size_t queued;   // run on the I/O threads
+        size_t inlined;  // run on the event loop, its queue being full
+        size_t pending;  // queued, not completed yet
+        size_t peak;     // most pending at once on one event loop
+    };
+
     class ResponseBodyType
     {
     public:
@@ -3,7 +3,11 @@
 
 #include <whs/common.h>
 
+#include <cassert>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <map>
 
 using Map = std::map<std::string, std::string>;
@@ -32,58 +36,168 @@ namespace whs
             XPoweredBy
         };
 
+        // keep in sync with the last CommonHeader
+        constexpr size_t CommonHeaderCount = static_cast<size_t>(CommonHeader::XPoweredBy) + 1;
+
         const std::string &mapCommonHeader(CommonHeader);
 
+        // `name' (case-insensitive) is a CommonHeader: put it into `h'
+        bool findCommonHeader(std::string_view name, CommonHeader &h);
+
         inline Map *createMap()
         {
             return new Map;
         }
+
+        /**
+         * @brief arena: monotonic allocator owning the bytes behind a request's string views.
+         *
+         * Memory is only released all at once by reset(), which keeps the largest block, so a
+         * request reusing the arena (keep-alive connection) does not touch the heap again.
+         */
+        class arena : noncopyable
+        {
+            struct _Block {
+                _Block *next;
+                size_t size;
+            };
+
+            _Block *_head;
+            char *_cur;
+            char *_end;
+
+            static constexpr size_t _minBlockSize = 4096;
+
+            char *grow(size_t);
+
+        public:
+            arena() : _head(nullptr), _cur(nullptr), _end(nullptr) {}
+            ~arena();
+
+            char *allocate(size_t size)
+            {
+                if (static_cast<size_t>(_end - _cur) < size) {
+                    return grow(size);
+                }
+                auto ret = _cur;
+                _cur += size;
+                return ret;
+            }
+
+            // aligned to `align', a power of two up to alignof(std::max_align_t)
+            char *allocate(size_t size, size_t align)
+            {
+                auto pad = -reinterpret_cast<uintptr_t>(_cur) & (align - 1);
+                if (static_cast<size_t>(_end - _cur) < pad + size) {
+                    // blocks start aligned
+                    return grow(size);
+                }
+                _cur += pad;
+                return allocate(size);
+            }
+
+            std::string_view copy(std::string_view);
+
+            // `head' followed by `tail'. `head' is extended in place if it is the last allocation
+            std::string_view append(std::string_view head, std::string_view tail);
+
+            void reset();
+
+            // reset(), then free the block kept too if it is larger than `limit' bytes. Whether
+            // it did
+            bool shrink(size_t limit);
+
+            void swap(arena &);
+        };
+
+        // ASCII case-insensitive equality, for header names
+        bool iequals(std::string_view, std::string_view);
     }  // namespace utils
 
+    /**
+     * @brief Resume: continues the pipelines of a request suspended by Request::suspend().
+     *
+     * Call it once, on the thread of the connection (the event loop which ran the stage), when
+     * the work the stage waited for is done. The next stage runs right away, within the call.
+     */
+    class Resume
+    {
+        Client *_client;
+
+    public:
+        explicit Resume(Client *c = nullptr) : _client(c) {}
+
+        void operator()();
+    };
+
     class RestfulHttpRequest : private utils::noncopyable
     {
         friend HttpParser;
-
-        Map *_cookies;
+        friend route::HttpRouter;
+        friend Client;
 
         // if we have a HTTP route as /usr/{name}/information
         // then we get an request: GET /user/tj/information
         // so, we have an param "name" = "tj"
-        Map *_params;
+        // names point into the router, values into the URL
+        std::vector<std::pair<std::string_view, std::string_view>> _params;
 
         // queries: /index.html?first=a&second=b&third=c
-        Map *_queries;
+        // split from `_queryString' by the first query access. Names and values point into the
+        // query string, or into `_arena' when they had to be decoded
+        mutable std::vector<std::pair<std::string_view, std::string_view>> _queries;
+        mutable bool _queriesParsed;
 
+        // in the body buffer of the parser, or in `_arena' when set by setBody. NUL-terminated
         const char *_body;
 
-        std::string _baseURL;
+        // views into the connection read buffer, or into `_arena' for bytes that had to be copied
+        std::string_view _baseURL;
+        std::string_view _queryString;
 
         int _method;
 
         unsigned int _bodySize;
 
-        Map _headers;
+        std::vector<std::pair<std::string_view, std::string_view>> _headers;
+
+        // keys in `_arena'
+        std::vector<std::pair<std::string_view, void *>> process_data;
 
-        std::map<std::string, void *> process_data;
+        // the bytes of the request: copied strings, body, coroutine frames. Reset with the
+        // request, its largest block kept for the next one of the connection
+        mutable utils::arena _arena;
+
+        // the connection which received it, nullptr if the request was built otherwise
+        Client *_client;
+        bool _suspended;
 
         RestfulHttpRequest(const RestfulHttpRequest &) = delete;
 
+        void parseQueries() const;
+
+        // drop the previous request but keep capacity (header slots, arena) for the next one
+        void reset();
+
     public:
         RestfulHttpRequest();
 
+        // an existing key is not replaced
         void put_processing_data(const std::string &key, void *data)
         {
-            process_data.emplace(key, data);
+            if (get_processing_data(key) == nullptr) {
+                process_data.emplace_back(_arena.copy(key), data);
+            }
         }
 
         void *get_processing_data(const std::string &key)
         {
-            auto find = process_data.find(key);
-            if (find == process_data.end()) {
-                return nullptr;
-            } else {
-                return find->second;
+            for (const auto &entry : process_data) {
+                if (entry.first == key) {
+                    return entry.second;
+                }
             }
+            return nullptr;
         }
 
         RestfulHttpRequest(RestfulHttpRequest &&);
@@ -92,6 +206,35 @@ namespace whs
 
         void swap(RestfulHttpRequest &);
 
+        /**
+         * @brief stop the pipelines once the current stage (middleware or handler) returns,
+         * until the returned Resume is called. For stages waiting on I/O or timers.
+         *
+         * The request and its response stay where they are, owned by the connection, so the
+         * stage may keep references to both. Views into the request taken before suspend() are
+         * invalid after the stage returns, get them again. Later requests of the connection
+         * wait: responses keep their order. Only for requests received by a server.
+         */
+        Resume suspend();
+
+        /**
+         * @brief copy what the request points to in the read buffer into the request, so that
+         * views taken from it afterwards stay valid once the stage returns, even if it suspends.
+         * For stages which take views before they know whether they suspend (see task).
+         */
+        void pin();
+
+        bool isSuspended() const
+        {
+            return _suspended;
+        }
+
+        // `size' bytes released with the request, e.g. coroutine frames (see task)
+        void *allocate(size_t size, size_t align)
+        {
+            return _arena.allocate(size, align);
+        }
+
         int getHeaderCount() const
         {
             return _headers.size();
@@ -104,6 +247,9 @@ namespace whs
 
         bool getQuery(const std::string &qname, std::string &out) const;
 
+        // `out' is valid as long as the request
+        bool getQuery(std::string_view qname, std::string_view &out) const;
+
         int getQueryCount() const;
 
         void setMethod(int m)
@@ -118,30 +264,34 @@ namespace whs
 
         void emplaceQuery(std::string &&, std::string &&);
 
-        void setBody(char *buf, size_t size)
+        // copy `size' bytes at `buf', which was allocated with new[] and is deleted
+        void setBody(char *buf, size_t size);
+
+        // valid as long as the request
+        std::string_view getBody() const
         {
-            _bodySize = size;
-            _body = buf;
+            return std::string_view(_body, _bodySize);
         }
 
-        void setBaseURL(const std::string &url)
+        void setBaseURL(std::string_view url)
         {
-            _baseURL = url;
+            _baseURL = _arena.copy(url);
         }
 
-        const std::string &getBaseURL() const
+        std::string_view getBaseURL() const
         {
             return _baseURL;
         }
 
-        void setBaseURL(std::string &&url)
+        // raw query string, without the leading '?'
+        std::string_view getQueryString() const
         {
-            _baseURL = url;
+            return _queryString;
         }
 
-        void emplaceHeader(std::string &&f, std::string &&v)
+        void emplaceHeader(std::string_view f, std::string_view v)
         {
-            _headers.emplace(f, v);
+            _headers.emplace_back(_arena.copy(f), _arena.copy(v));
         }
 
         void removeParam(std::string &&name);
@@ -150,141 +300,279 @@ namespace whs
 
         bool getParam(const std::string &p, std::string &v) const;
 
+        // `v' is valid as long as the request
+        bool getParam(std::string_view p, std::string_view &v) const;
+
         void addParam(const std::string &name, const std::string &value);
 
-        bool getHeader(const std::string &h, std::string &v);
+        bool getHeader(const std::string &h, std::string &v) const;
+
+        // header names are compared case-insensitively. `v' is valid as long as the request
+        bool getHeader(std::string_view h, std::string_view &v) const;
     };
 
-    class RestfulHttpResponse
+    /**
+     * @brief BodyChunk: a piece of a response body, written to the network as it is.
+     *
+     * Either `size' bytes at `data', or, when `fd' is not -1, `size' bytes of file `fd' from
+     * `offset', which backends send without reading them into user space. Once the chunk is sent
+     * (or dropped), `release' is called with it, unless it is nullptr.
+     */
+    struct BodyChunk {
+        const char *data;
+        size_t size;
+        void (*release)(const BodyChunk &);
+        void *arg;
+        int fd = -1;
+        uint64_t offset = 0;
+    };
+
+    /**
+     * @brief Deferred: the blocking part of a response (opening, reading files), run off the
+     * event loop.
+     *
+     * A middleware hands it to Response::defer() and returns, the pipelines go on as usual.
+     * Then run() is called on an I/O thread, and complete() on the thread of the connection,
+     * where it finishes the response before it is sent. Backends without I/O threads call both
+     * right away. The backend deletes it afterwards.
+     */
+    class Deferred
     {
-        const char *_body;
+    public:
+        virtual ~Deferred() {}
+
+        // on an I/O thread. The request is gone by then: keep copies of what it needs
+        virtual void run() = 0;
+
+        // on the thread of the connection, after run()
+        virtual void complete(RestfulHttpResponse &) = 0;
+    };
 
+    class RestfulHttpResponse
+    {
         int _status;
-        unsigned int _bodySize;
+        size_t _bodySize;
         bool _end;
+        Deferred *_deferred;
 
+        // body chunks, in `_chunks' first, in `_moreChunks' when it is full
+        static constexpr size_t _inlineChunks = 4;
 
-    public:
-        class HeaderName
+        size_t _chunkCount;
+        BodyChunk _chunks[_inlineChunks];
+        std::vector<BodyChunk> _moreChunks;
+
+        using _View = std::string_view;
+
+        // common headers live in a slot indexed by CommonHeader, `_commonSet' tells which are
+        // set. Other headers are appended, in `_custom' first, in `_moreCustom' when it is full.
+        // Names and values are copied into `_inline', or into `_overflow' once it is full, so a
+        // usual response does not allocate.
+        static constexpr size_t _inlineCustom = 8;
+        static constexpr size_t _inlineBytes = 512;
+
+        uint32_t _commonSet;
+        _View _common[utils::CommonHeaderCount];
+
+        size_t _customCount;
+        std::pair<_View, _View> _custom[_inlineCustom];
+        std::vector<std::pair<_View, _View>> _moreCustom;
+
+        size_t _inlineUsed;
+        char _inline[_inlineBytes];
+        utils::arena _overflow;
+
+        // pre-serialized header lines, see addRawHeaders. In `_rawHeaders' first, in
+        // `_moreRawHeaders' when it is full
+        static constexpr size_t _inlineRawHeaders = 4;
+        _View _rawHeaders[_inlineRawHeaders];
+        size_t _rawHeaderCount;
+        std::vector<_View> _moreRawHeaders;
+
+        using pair = std::pair<std::string_view, std::string_view>;
+
+        _View store(_View);
+
+        // value slot of a header, nullptr if not set
+        _View *find(utils::CommonHeader h)
         {
-            HeaderName(const HeaderName &) = delete;
-            HeaderName &operator=(const HeaderName &) = delete;
+            auto i = static_cast<size_t>(h);
+            return (_commonSet >> i & 1) != 0 ? &_common[i] : nullptr;
+        }
 
-            union _Name {
-                std::string *hname;
-                utils::CommonHeader cheader;
-                _Name() {}
-                ~_Name() {}
-            };
+        _View *find(_View name);
+
+        // value slot of a header, added with an empty value if not set
+        _View &slot(utils::CommonHeader h)
+        {
+            auto i = static_cast<size_t>(h);
+            if ((_commonSet >> i & 1) == 0) {
+                _commonSet |= 1u << i;
+                _common[i] = _View();
+            }
+            return _common[i];
+        }
+
+        _View &slot(_View name);
+
+        void setContentLength(size_t);
 
-            enum class _Store { STRING, ENUM, NONE };
+        // release the body chunks and forget them
+        void dropBody();
 
-            _Name name;
-            _Store store;
+        RestfulHttpResponse(const RestfulHttpResponse &) = delete;
+        RestfulHttpResponse &operator=(const RestfulHttpResponse &) = delete;
+
+    public:
+        /**
+         * @brief HeaderValue: reference to the value of a header of a response.
+         * Assigning copies the bytes into the response.
+         */
+        class HeaderValue
+        {
+            RestfulHttpResponse *_resp;
+            _View *_value;
 
         public:
-            size_t length() const
+            HeaderValue(RestfulHttpResponse *r, _View *v) : _resp(r), _value(v) {}
+
+            HeaderValue &operator=(_View v)
             {
-                const std::string &str = *this;
-                return str.length();
+                *_value = _resp->store(v);
+                return *this;
             }
 
-            const std::string &to_string() const
+            bool empty() const
             {
-                if (store == _Store::STRING) {
-                    return *name.hname;
-                } else {
-                    return utils::mapCommonHeader(name.cheader);
-                }
+                return _value->empty();
             }
 
-            operator const std::string &() const
+            operator _View() const
             {
-                return to_string();
+                return *_value;
             }
 
-            ~HeaderName()
+            bool operator==(_View v) const
             {
-                if (store == _Store::STRING) {
-                    delete name.hname;
-                }
+                return *_value == v;
             }
+        };
 
-            HeaderName(HeaderName &&h);
+        ~RestfulHttpResponse()
+        {
+            dropBody();
+            delete _deferred;
+        }
 
-            explicit HeaderName(utils::CommonHeader ch)
-            {
-                store = _Store::ENUM;
-                name.cheader = ch;
-            }
+        RestfulHttpResponse()
+        {
+            _bodySize = 0;
+            _chunkCount = 0;
+            _status = 0;
+            _end = false;
+            _deferred = nullptr;
+            _commonSet = 0;
+            _customCount = 0;
+            _inlineUsed = 0;
+            _rawHeaderCount = 0;
+        }
 
-            explicit HeaderName(std::string &&s)
-            {
-                name.hname = new std::string(s);
-                store = _Store::STRING;
-            }
+        /**
+         * @brief take over headers, body and Deferred of `o', which is left empty. For backends
+         * keeping a deferred response until it completes.
+         */
+        RestfulHttpResponse(RestfulHttpResponse &&o);
 
-            explicit HeaderName(const std::string &s)
-            {
-                name.hname = new std::string(s);
-                store = _Store::STRING;
-            }
+        // forget headers, body and Deferred, keeping the allocated capacity for the next response
+        void reset();
 
-            bool operator<(const HeaderName &h) const;
+        // after reset(): free the header bytes allocated beyond `limit'. Whether it did
+        bool shrink(size_t limit);
 
-            struct less {
-                bool operator()(const HeaderName &lhs, const HeaderName &rhs) const
-                {
-                    return lhs < rhs;
-                }
-            };
-        };
+        // head and body, copied into one buffer allocated with new[]
+        void toBytes(char **ptr, size_t &size);
 
-        using ResponseHeaderMapType = std::map<HeaderName, std::string, HeaderName::less>;
+        // complete the head (Content-Length) and return its size, status line to empty line
+        size_t prepareHead();
 
-    private:
-        ResponseHeaderMapType _headers;
+        // serialize the head prepared by prepareHead() at `p', return the end of it
+        char *writeHead(char *p) const;
 
-        using pair = std::pair<std::string, std::string>;
+        size_t bodySize() const
+        {
+            return _bodySize;
+        }
 
-    public:
-        ~RestfulHttpResponse()
+        size_t bodyChunkCount() const
         {
-            if (_body) {
-                delete[] _body;
-            }
+            return _chunkCount + _moreChunks.size();
         }
 
-        RestfulHttpResponse()
+        /**
+         * @brief hand the body chunks to `f', in order. The response forgets them, releasing
+         * them is up to `f'.
+         */
+        template <class F>
+        void takeBody(F &&f)
         {
-            _body = nullptr;
+            for (size_t i = 0; i < _chunkCount; ++i) {
+                f(_chunks[i]);
+            }
+            for (const auto &c : _moreChunks) {
+                f(c);
+            }
+            _chunkCount = 0;
+            _moreChunks.clear();
             _bodySize = 0;
-            _status = 0;
-            _end = false;
         }
 
-        void toBytes(char **ptr, size_t &size);
+        // add a header, unless it is already set
+        void addHeader(std::string_view field, std::string_view value)
+        {
+            if (find(field) == nullptr) {
+                slot(field) = store(value);
+            }
+        }
+
+        // add a header, unless it is already set
+        void addHeader(utils::CommonHeader h, std::string_view value)
+        {
+            addHeaderIfNotExists(h, value);
+        }
 
-        void addHeader(const std::string &field, const std::string &value)
+        bool hasHeader(utils::CommonHeader h) const
         {
-            _headers.emplace(field, value);
+            return (_commonSet >> static_cast<size_t>(h) & 1) != 0;
         }
 
-        void addHeader(utils::CommonHeader h, const std::string &value)
+        // value of a header, empty if not set
+        std::string_view getHeader(utils::CommonHeader h) const
         {
-            _headers.emplace(h, value);
+            return hasHeader(h) ? _common[static_cast<size_t>(h)] : _View();
         }
 
-        bool addHeaderIfNotExists(utils::CommonHeader h, const std::string &value)
+        /**
+         * @brief append pre-serialized header lines ("Name: value\r\n", one or more) to the
+         * response head, after the other headers.
+         * The bytes are not copied, `lines' must stay valid until the response is serialized.
+         * Headers added this way are not visible through operator[] and hasHeader.
+         */
+        void addRawHeaders(std::string_view lines)
         {
-            HeaderName hn(h);
-            auto f = _headers.find(hn);
-            if (f == _headers.end()) {
-                _headers.emplace(std::move(hn), value);
-                return true;
+            if (_rawHeaderCount < _inlineRawHeaders) {
+                _rawHeaders[_rawHeaderCount++] = lines;
             } else {
+                _moreRawHeaders.push_back(lines);
+            }
+        }
+
+        bool addHeaderIfNotExists(utils::CommonHeader h, std::string_view value)
+        {
+            if (hasHeader(h)) {
                 return false;
             }
+            slot(h) = store(value);
+            return true;
         }
 
         void status(int i)
@@ -297,20 +585,24 @@ namespace whs
             return _status;
         }
 
-        std::string &operator[](utils::CommonHeader h)
+        // the value of header `h', which is added with an empty value if not set
+        HeaderValue operator[](utils::CommonHeader h)
         {
-            HeaderName n(h);
-            return _headers[std::move(n)];
+            return HeaderValue(this, &slot(h));
         }
 
-        std::string &operator[](const std::string &f)
+        // the value of header `f', which is added with an empty value if not set
+        HeaderValue operator[](std::string_view f)
         {
-            HeaderName n(f);
-            return _headers[std::move(n)];
+            return HeaderValue(this, &slot(f));
         }
 
+        // replace the body by `buf', which was allocated with new[] and is owned by the response
         void setBody(const char *buf, size_t size);
 
+        // append a chunk to the body, Content-Length follows
+        void appendBody(const BodyChunk &);
+
         void setBody(const ResponseBodyType *t)
         {
             char *buf;
@@ -323,11 +615,14 @@ namespace whs
             }
         }
 
-        auto operator[](pair p)
+        // add header p.first: p.second unless already set. true if added
+        bool operator[](pair p)
         {
-            HeaderName n(p.first);
-
-            return _headers.insert(std::make_pair(std::move(n), p.second));
+            if (find(p.first) != nullptr) {
+                return false;
+            }
+            slot(p.first) = store(p.second);
+            return true;
         }
 
         bool isBodySet() const
@@ -335,6 +630,30 @@ namespace whs
             return _status != 0;
         }
 
+        /**
+         * @brief finish the response with `d', off the event loop. The response is sent once
+         * `d' completed it, later responses of the connection wait for it.
+         * Takes `d'. At most one per response.
+         */
+        void defer(Deferred *d)
+        {
+            assert(_deferred == nullptr);
+            _deferred = d;
+        }
+
+        bool isDeferred() const
+        {
+            return _deferred != nullptr;
+        }
+
+        // the Deferred of the response, nullptr if none. The caller owns it
+        Deferred *takeDeferred()
+        {
+            auto d = _deferred;
+            _deferred = nullptr;
+            return d;
+        }
+
         void end()
         {
             _end = true;
@@ -0,0 +1,65 @@
+#ifndef WHS_PIPELINE_H_
+#define WHS_PIPELINE_H_
+
+#include <whs/builder.h>
+#include <whs/entity.h>
+
+#include <cstddef>
+#include <tuple>
+#include <utility>
+
+namespace whs
+{
+    /**
+     * @brief StaticPipeline: middlewares chained at compile time.
+     *
+     * A Pipeline makes a virtual call per middleware. Here stages are called by their type, so
+     * the compiler can inline the whole chain: a Pipeline makes one virtual call for it. Hand it
+     * to a PipelineBuilder, whose pipeline runs it before the middlewares added:
+     *
+     *     PipelineBuilder before(new StaticPipeline<Auth, Cors, AccessLog>);
+     *     whs.setup(&before, &routes, nullptr);
+     *
+     * Stages are default constructed. As in a Pipeline, their result is ignored, and one may
+     * suspend the request: the chain goes on with the next stage on resume.
+     */
+    template <class... M>
+    class StaticPipeline final : public StaticStages
+    {
+        static_assert(sizeof...(M) > 0, "a StaticPipeline needs stages");
+
+        std::tuple<M...> _stages;
+
+        template <size_t I>
+        bool step(Request &req, Response &res, size_t &next) const THROWS
+        {
+            using Stage = std::tuple_element_t<I, std::tuple<M...>>;
+            next = I + 1;
+            std::get<I>(_stages).Stage::operator()(req, res);
+            return !req.isSuspended();
+        }
+
+        template <size_t... I>
+        bool feed(Request &req, Response &res, size_t &next, std::index_sequence<I...>) const
+            THROWS
+        {
+            // stages before `next' already ran
+            bool going = true;
+            ((going = going && (I < next || step<I>(req, res, next))), ...);
+            return going;
+        }
+
+    public:
+        virtual size_t size() const override
+        {
+            return sizeof...(M);
+        }
+
+        virtual bool feed(Request &req, Response &res, size_t &next) const THROWS override
+        {
+            return feed(req, res, next, std::index_sequence_for<M...>{});
+        }
+    };
+}  // namespace whs
+
+#endif
@@ -0,0 +1,363 @@
+#ifndef WHS_TASK_H_
+#define WHS_TASK_H_
+
+#include <whs/entity.h>
+#include <whs/whs.h>
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#ifdef ENABLE_LIBUV
+#include <uv.h>
+#endif
+
+namespace whs
+{
+    template <class T = void>
+    class task;
+
+    namespace utils
+    {
+        /**
+         * @brief frames of coroutines taking a Request come from its arena, which the connection
+         * keeps between requests, so a suspension does not allocate. Others come from the heap.
+         */
+        struct frame {
+            static constexpr size_t header = alignof(std::max_align_t);
+
+            static Request *request(Request *found, Request &r)
+            {
+                return found != nullptr ? found : &r;
+            }
+
+            template <class A>
+            static Request *request(Request *found, A &)
+            {
+                return found;
+            }
+
+            static void *allocate(size_t size, Request *);
+
+            static void release(void *);
+        };
+
+        // where a handler coroutine which suspended goes on once completed
+        struct root {
+            Resume resume;
+            Response *resp;
+        };
+
+        // answer `r' with `error', if any, then resume its request
+        void complete(root *r, std::exception_ptr error) noexcept;
+
+        struct promise_base {
+            std::coroutine_handle<> continuation;
+            std::exception_ptr error;
+            root *detached = nullptr;
+
+            template <class... Args>
+            static void *operator new(size_t size, Args &... args)
+            {
+                Request *req = nullptr;
+                ((req = frame::request(req, args)), ...);
+                return frame::allocate(size, req);
+            }
+
+            static void operator delete(void *p)
+            {
+                frame::release(p);
+            }
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            struct final_awaiter {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                template <class P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+                {
+                    auto &p = h.promise();
+                    if (auto r = p.detached) {
+                        auto error = p.error;
+                        h.destroy();
+                        complete(r, error);
+                        return std::noop_coroutine();
+                    }
+                    return p.continuation ? p.continuation : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            final_awaiter final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void unhandled_exception() noexcept
+            {
+                error = std::current_exception();
+            }
+        };
+
+        template <class T>
+        struct promise : promise_base {
+            std::optional<T> value;
+
+            task<T> get_return_object();
+
+            template <class V>
+            void return_value(V &&v)
+            {
+                value.emplace(std::forward<V>(v));
+            }
+        };
+
+        template <>
+        struct promise<void> : promise_base {
+            task<void> get_return_object();
+
+            void return_void() noexcept {}
+        };
+    }  // namespace utils
+
+    /**
+     * @brief task: a coroutine, started when awaited. `co_await' on it gives its result, or
+     * rethrows what it threw.
+     */
+    template <class T>
+    class task
+    {
+        friend class AsyncMiddleware;
+
+    public:
+        using promise_type = utils::promise<T>;
+
+    private:
+        std::coroutine_handle<promise_type> _h;
+
+    public:
+        explicit task(std::coroutine_handle<promise_type> h) : _h(h) {}
+
+        task(task &&o) noexcept : _h(std::exchange(o._h, nullptr)) {}
+
+        task(const task &) = delete;
+
+        ~task()
+        {
+            if (_h) {
+                _h.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiting) noexcept
+        {
+            _h.promise().continuation = waiting;
+            return _h;
+        }
+
+        T await_resume()
+        {
+            auto &p = _h.promise();
+            if (p.error) {
+                std::rethrow_exception(p.error);
+            }
+            if constexpr (!std::is_void_v<T>) {
+                return std::move(*p.value);
+            }
+        }
+    };
+
+    template <class T>
+    task<T> utils::promise<T>::get_return_object()
+    {
+        return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+    }
+
+    inline task<void> utils::promise<void>::get_return_object()
+    {
+        return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+    }
+
+    /**
+     * @brief AsyncMiddleware: a middleware or handler written as a coroutine.
+     *
+     * When handle() suspends, so does the request (see Request::suspend): the pipelines go on
+     * once it completes. A HttpException it throws meanwhile becomes the response, as in the
+     * pipelines, any other exception a 500. The request is pinned (see Request::pin) before
+     * handle() runs, so views taken from it stay valid across co_await.
+     */
+    class AsyncMiddleware : public Middleware
+    {
+    public:
+        virtual task<> handle(Request &, Response &) const = 0;
+
+        virtual bool operator()(Request &, Response &) const THROWS override final;
+    };
+
+#ifdef ENABLE_LIBUV
+    /**
+     * @brief delay: `co_await delay(ms)' resumes on the loop of the connection `ms'
+     * milliseconds later.
+     */
+    class delay
+    {
+        uv_timer_t _timer;
+        uint64_t _ms;
+        std::coroutine_handle<> _waiting;
+
+    public:
+        explicit delay(uint64_t ms) : _ms(ms) {}
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<>);
+
+        void await_resume() const noexcept {}
+    };
+
+    /**
+     * @brief fs: a libuv file system request to `co_await', which gives its result.
+     *
+     *     whs::fs st;
+     *     auto err = co_await st([&](uv_loop_t *l, uv_fs_t *req, uv_fs_cb cb) {
+     *         return uv_fs_stat(l, req, path.c_str(), cb);
+     *     });
+     *     // st.request().statbuf
+     *
+     * The request lives in the coroutine frame. It is cleaned up by the next operation, or
+     * the destructor.
+     */
+    class fs : utils::noncopyable
+    {
+        uv_fs_t _req;
+        std::coroutine_handle<> _waiting;
+        bool _used;
+
+        static void done(uv_fs_t *);
+
+        // prepare for an operation, return the loop to run it on
+        uv_loop_t *begin();
+
+    public:
+        fs() : _used(false) {}
+
+        ~fs()
+        {
+            if (_used) {
+                uv_fs_req_cleanup(&_req);
+            }
+        }
+
+        const uv_fs_t &request() const
+        {
+            return _req;
+        }
+
+        // `start(loop, req, cb)' calls an uv_fs_* function with them
+        template <class Start>
+        auto operator()(Start start)
+        {
+            struct awaiter {
+                fs &op;
+                Start start;
+                int status;
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                bool await_suspend(std::coroutine_handle<> h)
+                {
+                    op._waiting = h;
+                    status = start(op.begin(), &op._req, &fs::done);
+                    // failed to start: no callback comes
+                    return status == 0;
+                }
+
+                ssize_t await_resume() const noexcept
+                {
+                    return status != 0 ? status : op._req.result;
+                }
+            };
+            return awaiter{*this, std::move(start), 0};
+        }
+    };
+
+    /**
+     * @brief completion: a value delivered by another thread. A coroutine `co_await's it on
+     * the loop of its connection, any thread calls complete() once, which resumes the coroutine
+     * on that loop. The completion must outlive the call to complete().
+     */
+    template <class T>
+    class completion : utils::Posted, utils::noncopyable
+    {
+        enum { EMPTY, WAITING, DONE };
+
+        std::optional<T> _value;
+        std::atomic<int> _state;
+        utils::Reactor *_reactor;
+        std::coroutine_handle<> _waiting;
+
+    public:
+        completion() : _state(EMPTY), _reactor(nullptr)
+        {
+            run = [](utils::Posted *p) { static_cast<completion *>(p)->_waiting.resume(); };
+        }
+
+        template <class V>
+        void complete(V &&v)
+        {
+            _value.emplace(std::forward<V>(v));
+            if (_state.exchange(DONE, std::memory_order_acq_rel) == WAITING) {
+                LibuvWhs::post(_reactor, this);
+            }
+        }
+
+        bool await_ready() const noexcept
+        {
+            return _state.load(std::memory_order_acquire) == DONE;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            _waiting = h;
+            _reactor = LibuvWhs::current();
+            int empty = EMPTY;
+            if (!_state.compare_exchange_strong(empty, WAITING, std::memory_order_acq_rel)) {
+                // completed meanwhile
+                return false;
+            }
+            // the post runs on this thread, so after this
+            LibuvWhs::expect(_reactor);
+            return true;
+        }
+
+        T await_resume()
+        {
+            return std::move(*_value);
+        }
+    };
+#endif
+}  // namespace whs
+
+#endif
@@ -113,9 +113,12 @@ namespace whs
 
             bool match(const char *test) const;
 
+            // match `length' bytes at `test', which need not be NUL-terminated
+            bool match(const char *test, size_t length) const;
+
             bool match(const std::string &test) const
             {
-                return match(test.c_str());
+                return match(test.c_str(), test.length());
             }
 
             bool execute(const char *test, std::vector<regex_group> &group) const;
@@ -190,10 +193,29 @@ namespace whs
         Middleware *systemError;  // 500
         Middleware *staticFile;
 
+    public:
+        // where the pipelines of a request stand: the next middleware of `stage' is `index'
+        struct Progress {
+            enum Stage { BEFORE, ROUTE, AFTER, DONE } stage = BEFORE;
+            size_t index = 0;
+        };
+
     protected:
         Whs();
 
-        void processing_request(Request &req, Response &resp);
+        /**
+         * @brief run the stages of `req' from `at' on
+         * @return false if a stage suspended the request, `at' is then where it resumes
+         */
+        bool processing_request(Request &req, Response &resp, Progress &at);
+
+        /**
+         * @brief a suspended request of `c' resumed and was answered, as were the requests
+         * received meanwhile, unless one of them is suspended in turn. Called last, the backend
+         * may free `c'. Default: nothing
+         * @param ok false if the bytes received meanwhile are not HTTP: `c' should be closed
+         */
+        virtual void resumed(Client *c, bool ok);
 
     protected:
         virtual bool _start() = 0;
@@ -202,7 +224,12 @@ namespace whs
     public:
         virtual ~Whs();
 
-        virtual void write(Client *, char *, size_t) = 0;
+        // send `size' bytes at `buf', which was allocated with new[] and is owned by the server
+        virtual void write(Client *, char *buf, size_t size) = 0;
+
+        // send a response, taking its body. Default: copy it into one buffer for write() above
+        virtual void write(Client *, Response &);
+
         virtual bool stop() = 0;
         virtual bool init() = 0;
 
@@ -212,6 +239,48 @@ namespace whs
 
         bool enable_static_file(const std::string &, const std::string &);
 
+        /**
+         * @brief set the memory budget of the static file cache. Must be called after
+         * enable_static_file(). Default: 64 MiB, files up to 256 KiB.
+         *
+         * Files up to `maxFileSize' bytes are served from memory once read, larger ones are
+         * always sent from disk. A modified file is dropped from the cache.
+         * @param budget body bytes kept in memory, 0 disables the cache
+         * @return false if static files are not enabled
+         */
+        bool setStaticFileCache(size_t budget, size_t maxFileSize);
+
+        // static file cache counters. All zero if static files are not enabled
+        FileCacheStats getStaticFileCacheStats() const;
+
+        /**
+         * @brief keep the ETags of static files in `file', so that a restart only hashes the
+         * files changed meanwhile. Must be called after enable_static_file() and before start().
+         *
+         * ETags are hashes of the content. The index maps inode, size and modification time to
+         * a hash, `file' is rewritten when files were hashed.
+         * @param file outside the static directory
+         * @return false if static files are not enabled, or `file' is in the static directory
+         */
+        bool setStaticFileEtagIndex(const std::string &file);
+
+        /**
+         * @brief add the Content-Types listed in a mime.types file to the builtin ones. Must be
+         * called after enable_static_file() and before start().
+         *
+         * Each line is a type followed by its extensions, '#' starts a comment. Extensions are
+         * matched ignoring case, a listed one overrides its builtin type.
+         * @return false if static files are not enabled, or `file' is unreadable
+         */
+        bool setStaticFileMimeTypes(const std::string &file);
+
+        /**
+         * @brief set the thread count of the pool running offloaded handlers (see
+         * HttpRouteBuilder::offload), shared by all servers. Must be called before the first
+         * offloaded request. Default: one per CPU.
+         */
+        static void setOffloadThreads(unsigned int count);
+
         template <class T, class... Args>
         auto setNotFoundHandler(Args &&... args) -> EnableIfMiddleType<T, void>
         {
@@ -243,6 +312,7 @@ namespace whs
         void reset();
         size_t readable_size();
 
+        using Whs::write;
         virtual void write(Client *, char *, size_t) override;
     };
 
@@ -265,6 +335,16 @@ namespace whs
 #ifdef ENABLE_LIBUV
     namespace utils
     {
+        struct Reactor;
+
+        /**
+         * @brief Posted: work handed to a reactor by another thread, see LibuvWhs::post().
+         */
+        struct Posted {
+            Posted *next;
+            void (*run)(Posted *);
+        };
+
         void uvConnectCB(uv_stream_s *, int flag);
 
         void uvAsyncStopCB(uv_async_s *);
@@ -278,24 +358,108 @@ namespace whs
         friend void utils::uvConnectCB(uv_stream_s *, int);
         friend void utils::uvReadCB(uv_stream_s *, ssize_t, const uv_buf_t *);
 
-        uv_loop_s *loop;
-        uv_async_s *stop_async;
-        uv_tcp_s *server;
-        utils::mutex *m;
-        bool externalLoop;
+        // one event loop (reactor) per worker. reactors[0] runs on the thread calling start(),
+        // the others get their own threads and listening sockets bound with SO_REUSEPORT,
+        // so the kernel shards accepted connections between them.
+        utils::Reactor *reactors;
+        unsigned int workers;
+        uv_loop_s *externalLoop;
+        std::vector<size_t> readBufferSizes;
+        size_t deferredDepth;
+        size_t connectionPoolSize;
 
         virtual bool _setup() override;
 
-        void stop_uv();
+        bool listen(utils::Reactor &);
+
+        void stop_uv(utils::Reactor &);
 
         virtual void write(Client *, char *, size_t) override;
 
+        // head and body chunks go out in one vectored uv_write, the body is not copied
+        virtual void write(Client *, Response &) override;
+
+        // reads again, stopped while the request was suspended
+        virtual void resumed(Client *, bool) override;
+
     public:
         LibuvWhs(std::string &&host, uint16_t port);
         LibuvWhs(std::string &&host, uint16_t port, uv_loop_s *);
 
         virtual ~LibuvWhs();
 
+        /**
+         * @brief set the number of event loops serving requests. Must be called before setup().
+         *
+         * Every worker owns an uv loop, a thread and a listening socket. Pipelines, router and
+         * handlers are shared between workers, so they must not be modified after start().
+         * @param count worker count. 0 means one worker per CPU.
+         * Ignored when running on an external loop.
+         */
+        void setWorkerCount(unsigned int count);
+
+        unsigned int getWorkerCount() const
+        {
+            return workers;
+        }
+
+        /**
+         * @brief set slab sizes (ascending) of the per-loop read buffer pools. Must be called
+         * before setup(). Default: 4, 16 and 64 KiB.
+         *
+         * A read borrows a slab only for the duration of the read callback, so idle connections
+         * hold no buffer. A connection starts on the smallest size and moves to a larger one when
+         * a read fills its slab.
+         */
+        void setReadBufferSizes(const std::vector<size_t> &sizes);
+
+        // read buffer pool counters, summed over all workers
+        BufferPoolStats getReadBufferStats() const;
+
+        /**
+         * @brief set how many deferred responses (see Deferred) a worker queues for the libuv
+         * thread pool at most. Must be called before setup(). Default: 128.
+         *
+         * The thread pool also runs the sendfile of file bodies, its size is set by the
+         * UV_THREADPOOL_SIZE environment variable. A response deferred while the queue is full
+         * completes on the event loop, as if it was not deferred. 0 does so for all.
+         */
+        void setDeferredQueueDepth(size_t depth);
+
+        // deferred response counters, summed over all workers
+        DeferredStats getDeferredStats() const;
+
+        /**
+         * @brief set how many connections a worker keeps for reuse, allocated up front. Must be
+         * called before setup(). Default: 64.
+         *
+         * A connection (socket handle, parser, request and response with their buffers) goes
+         * back to the pool of its worker when closed, and serves the next accepted one. Beyond
+         * `size' pooled, closed connections are freed. Buffers grown over 64 KiB by a large
+         * message are freed when their connection goes back to the pool.
+         */
+        void setConnectionPoolSize(size_t size);
+
+        // connection pool counters, summed over all workers
+        ConnectionPoolStats getConnectionPoolStats() const;
+
+        // the reactor running on the calling thread, nullptr if none does
+        static utils::Reactor *current();
+
+        static uv_loop_s *loop(utils::Reactor *);
+
+        /**
+         * @brief announce a post() to `r', on its thread. The reactor does not stop before
+         * every announced post arrived.
+         */
+        static void expect(utils::Reactor *r);
+
+        /**
+         * @brief have `p->run(p)' called on the thread of `r'. Any thread may post, lock-free,
+         * posts run in order. Each post() answers one expect()
+         */
+        static void post(utils::Reactor *r, utils::Posted *p);
+
         virtual bool _start() override;
         virtual bool stop() override;
         virtual bool init() override;
@@ -1,26 +1,81 @@
 
 #include "client.h"
 
+#include <cassert>
+
 
 void Client::read_from_network(ssize_t size, const char* buf)
 {
     parser.readFromNetwork(buf, size);
 }
 
-void Client::processing_request(Request& req, Response& resp)
+void Client::processing_request(Request& req)
+{
+    response.reset();
+    progress = Whs::Progress();
+    run(req);
+}
+
+void Client::run(Request& req)
+{
+    running = true;
+    auto done = whs->processing_request(req, response, progress);
+    running = false;
+    if (done) {
+        write_response(response);
+        response.reset();
+    }
+}
+
+void Client::hold()
+{
+    parser.hold();
+}
+
+void Client::resume()
+{
+    auto& req = parser.current;
+    assert(req._suspended);
+    req._suspended = false;
+    if (running) {
+        // resumed by the stage which suspended: the pipelines go on once it returns
+        return;
+    }
+    run(req);
+    if (req._suspended) {
+        return;
+    }
+    bool ok = true;
+    try {
+        parser.resume();
+    } catch (const HttpParserException&) {
+        ok = false;
+    }
+    // last: the backend may free the connection
+    whs->resumed(this, ok);
+}
+
+void Resume::operator()()
 {
-    whs->processing_request(req, resp);
+    assert(_client != nullptr);
+    auto c = _client;
+    _client = nullptr;
+    c->resume();
 }
 
 void Client::write_response(Response& resp)
 {
-    char* buf;
-    size_t size;
-    resp.toBytes(&buf, size);
-    whs->write(this, buf, size);
+    whs->write(this, resp);
 }
 
 void Client::reset()
 {
     parser.reset();
+    response.reset();
+}
+
+bool Client::shrink(size_t limit)
+{
+    bool request = parser.shrink(limit);
+    return response.shrink(limit) || request;
 }
\ No newline at end of file
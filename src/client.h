@@ -6,7 +6,6 @@
 
 #include "parser.h"
 
-
 #include <http_parser.h>
 
 #ifdef ENABLE_LIBUV
@@ -24,14 +23,39 @@ namespace whs
 
         HttpParser parser;
 
+        // response of the request in the pipelines, and where they stand. Kept here rather than
+        // on the stack so that a suspended request can resume (see Request::suspend), and reused
+        // by the next request with its capacity
+        Response response;
+        Whs::Progress progress;
+        // the pipelines run: a Resume meanwhile only lets them go on
+        bool running;
+
+        void run(Request &);
+
     protected:
         void *data;
         Whs *whs;
 
-        void processing_request(Request &, Response &);
+        // a request is complete
+        void processing_request(Request &);
 
     public:
+        // the running stage suspended the current request: keep what it points to
+        void hold();
+
+        // continue the suspended request, then the ones received meanwhile
+        void resume();
+
+        bool suspended() const
+        {
+            return parser.current.isSuspended();
+        }
+
         void reset();
+        // after reset(): free the buffers grown over `limit' bytes by a large message. Whether
+        // any was
+        bool shrink(size_t limit);
         void write_response(Response &);
         void read_from_network(ssize_t, const char *);
         bool connection_should_close()
@@ -47,8 +71,8 @@ namespace whs
             return data;
         }
         ~Client(){};
-        Client(Whs *me) : parser(this), whs(me) {}
-        Client(Whs *me, void *d) : parser(this), data(d), whs(me) {}
+        Client(Whs *me) : parser(this), running(false), whs(me) {}
+        Client(Whs *me, void *d) : parser(this), running(false), data(d), whs(me) {}
     };
 }  // namespace whs
 
@@ -0,0 +1,269 @@
+#include "whs-internal.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <mutex>
+#include <new>
+#include <unistd.h>
+
+using namespace whs;
+using whs::utils::FileCache;
+
+namespace
+{
+    // entry, head and body in one block
+    FileCache::Entry *allocateEntry(uint64_t key, std::string_view head, size_t size)
+    {
+        auto block = static_cast<char *>(::operator new(sizeof(FileCache::Entry) + head.size()
+                                                        + size));
+        auto e = new (block) FileCache::Entry;
+        e->refs.store(1, std::memory_order_relaxed);
+        e->key = key;
+        e->slot = 0;
+        e->referenced.store(false, std::memory_order_relaxed);
+        auto p = block + sizeof(FileCache::Entry);
+        memcpy(p, head.data(), head.size());
+        e->head = std::string_view(p, head.size());
+        e->body = std::string_view(p + head.size(), size);
+        return e;
+    }
+
+    size_t lookupShard()
+    {
+        static std::atomic<size_t> next{0};
+        thread_local size_t s = next.fetch_add(1, std::memory_order_relaxed);
+        return s;
+    }
+
+    bool readAll(int fd, char *p, size_t size)
+    {
+        errno = 0;
+        size_t done = 0;
+        while (done < size) {
+            auto n = pread(fd, p + done, size - done, done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+}  // namespace
+
+FileCache::FileCache(size_t budget, size_t maxFileSize)
+    : pending(0),
+      snapshots(0),
+      newest(0),
+      hand(0),
+      budget(budget),
+      maxFileSize(maxFileSize),
+      bytes(0),
+      epoch(0)
+{
+    counters = {0, 0, 0, 0, 0, 0};
+}
+
+FileCache::~FileCache()
+{
+    for (auto e : retired) {
+        release(e);
+    }
+    for (auto e : clock) {
+        if (e != nullptr) {
+            release(e);
+        }
+    }
+}
+
+void FileCache::configure(size_t b, size_t max)
+{
+    std::unique_lock<mutex> guard(m);
+    for (auto e : clock) {
+        if (e != nullptr) {
+            retired.push_back(e);
+        }
+    }
+    entries.clear();
+    clock.clear();
+    freeSlots.clear();
+    hand = 0;
+    bytes = 0;
+    budget = b;
+    maxFileSize = max;
+    epoch.fetch_add(1, std::memory_order_acq_rel);
+    commit(guard);
+}
+
+void FileCache::release(Entry *e)
+{
+    if (e->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        e->~Entry();
+        ::operator delete(e);
+    }
+}
+
+// forget `e', called with the mutex held. Lookups may still find it until the next commit
+void FileCache::drop(Entry *e)
+{
+    entries.erase(e->key);
+    clock[e->slot] = nullptr;
+    freeSlots.push_back(e->slot);
+    bytes -= e->body.size();
+    retired.push_back(e);
+    ++pending;
+}
+
+// publish a copy of `entries' to the lookups. Called with the mutex held, which it releases
+// before waiting for the lookups
+void FileCache::commit(std::unique_lock<mutex> &guard)
+{
+    auto next = new Map(entries);
+    auto snapshot = ++snapshots;
+    std::vector<Entry *> dropped;
+    dropped.swap(retired);
+    pending = 0;
+    guard.unlock();
+    {
+        std::lock_guard<mutex> order(publishing);
+        if (snapshot > newest) {
+            published.publish(next);
+            newest = snapshot;
+        } else {
+            // a later copy is out, and its lookups drained: it knows `dropped' no more
+            delete next;
+        }
+    }
+    // no lookup sees a map holding them anymore, so none is about to reference them
+    for (auto e : dropped) {
+        release(e);
+    }
+}
+
+// evict until `size' more bytes fit, called with the mutex held
+bool FileCache::makeRoom(size_t size)
+{
+    if (size > budget) {
+        return false;
+    }
+    // two rounds clear every reference bit, so this ends
+    for (size_t steps = 0; bytes + size > budget && steps < 2 * clock.size() + 1; ++steps) {
+        if (hand >= clock.size()) {
+            hand = 0;
+        }
+        auto e = clock[hand++];
+        if (e == nullptr) {
+            continue;
+        }
+        if (e->referenced.load(std::memory_order_relaxed)) {
+            e->referenced.store(false, std::memory_order_relaxed);
+        } else {
+            drop(e);
+            ++counters.evictions;
+        }
+    }
+    return bytes + size <= budget;
+}
+
+FileCache::Entry *FileCache::get(uint64_t key)
+{
+    auto &counter = lookups[lookupShard() % shards];
+    auto snapshot = published.read();
+    auto found = snapshot->find(key);
+    if (found == snapshot->end()) {
+        counter.misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    auto e = found->second;
+    // the bit is shared by every worker hitting the entry, write it only when it changes
+    if (!e->referenced.load(std::memory_order_relaxed)) {
+        e->referenced.store(true, std::memory_order_relaxed);
+    }
+    e->refs.fetch_add(1, std::memory_order_relaxed);
+    counter.hits.fetch_add(1, std::memory_order_relaxed);
+    return e;
+}
+
+FileCache::Entry *FileCache::put(
+    uint64_t key, std::string_view head, int fd, size_t size, uint64_t since)
+{
+    // read without the lock, a concurrent invalidation is detected through the epoch
+    auto e = allocateEntry(key, head, size);
+    if (!readAll(fd, const_cast<char *>(e->body.data()), size)) {
+        logger::error(fmt::format("file cache: read failed: {}",
+                                  errno != 0 ? strerror(errno) : "unexpected end of file"));
+        release(e);
+        return nullptr;
+    }
+
+    std::unique_lock<mutex> guard(m);
+    if (entries.count(key) != 0) {
+        // another thread was faster, or the entry is not published yet and was missed: serve the
+        // bytes once, uncached
+        if (pending != 0) {
+            commit(guard);
+        }
+        return e;
+    }
+    if (epoch.load(std::memory_order_acquire) != since || !cacheable(size) || !makeRoom(size)) {
+        // the bytes may be stale
+        return e;
+    }
+    if (freeSlots.empty()) {
+        e->slot = clock.size();
+        clock.push_back(e);
+    } else {
+        e->slot = freeSlots.back();
+        freeSlots.pop_back();
+        clock[e->slot] = e;
+    }
+    entries.emplace(key, e);
+    bytes += size;
+    // one reference for the cache, one for the caller
+    e->refs.fetch_add(1, std::memory_order_relaxed);
+    if (++pending >= std::max<size_t>(1, entries.size() / 8)) {
+        commit(guard);
+    }
+    return e;
+}
+
+void FileCache::invalidate(uint64_t key)
+{
+    invalidate(std::vector<uint64_t>{key});
+}
+
+void FileCache::invalidate(const std::vector<uint64_t> &keys)
+{
+    std::unique_lock<mutex> guard(m);
+    epoch.fetch_add(1, std::memory_order_acq_rel);
+    bool dropped = false;
+    for (auto key : keys) {
+        auto found = entries.find(key);
+        if (found != entries.end()) {
+            drop(found->second);
+            ++counters.invalidations;
+            dropped = true;
+        }
+    }
+    // stale bytes must not be served: publish now, also if an unpublished drop of a key left it
+    // in the snapshot
+    if (dropped || pending != 0) {
+        commit(guard);
+    }
+}
+
+FileCacheStats FileCache::stats() const
+{
+    std::lock_guard<mutex> guard(m);
+    auto ret = counters;
+    for (auto &l : lookups) {
+        ret.hits += l.hits.load(std::memory_order_relaxed);
+        ret.misses += l.misses.load(std::memory_order_relaxed);
+    }
+    ret.entries = entries.size();
+    ret.bytes = bytes;
+    return ret;
+}
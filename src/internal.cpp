@@ -245,36 +245,71 @@ regex::~regex()
 
 bool regex::match(const char *test) const
 {
-    auto match_data = pcre2_match_data_create_from_pattern(re, NULL);
-    auto len = std::char_traits<char>::length(test);
-    auto rc = pcre2_match(re, reinterpret_cast<PCRE2_SPTR8>(test), len, 0, 0, match_data, NULL);
-    bool ret = rc == 1;
-    pcre2_match_data_free(match_data);
-    return ret;
+    return match(test, std::char_traits<char>::length(test));
+}
+
+namespace
+{
+    // match() only needs to know whether the subject matched, not where: one ovector pair is
+    // enough for any pattern (pcre2_match returns 0 instead of the group count then), and the
+    // match data is reused by every match on this thread.
+    struct MatchData {
+        pcre2_match_data *data = pcre2_match_data_create(1, NULL);
+        ~MatchData()
+        {
+            pcre2_match_data_free(data);
+        }
+    };
+}  // namespace
+
+bool regex::match(const char *test, size_t length) const
+{
+    static thread_local MatchData md;
+    auto rc = pcre2_match(re, reinterpret_cast<PCRE2_SPTR8>(test), length, 0, 0, md.data, NULL);
+    return rc >= 0;
 }
 #endif
 
 void whs::utils::format_time(std::string &out)
 {
     time_t now = time(nullptr);
-    auto t = gmtime(&now);
-    format_time(t, out);
+    struct tm t;
+    gmtime_r(&now, &t);
+    format_time(&t, out);
 }
 
 void whs::utils::format_time(const struct tm *t, std::string &out)
 {
-    const char day_names[][4] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
-    const char mon_names[][4] = {
+    char buf[DATE_LENGTH];
+    format_time(t, buf);
+    out.assign(buf, DATE_LENGTH);
+}
+
+void whs::utils::format_time(const struct tm *t, char *out)
+{
+    static constexpr char day_names[][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static constexpr char mon_names[][4] = {
         "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
-    // Date: <day-name>, <day> <month> <year> <hour>:<minute>:<second> GMT
-    auto f = fmt::format("{}, {} {} {} {}:{}:{} GMT",
-                         day_names[t->tm_wday],
-                         t->tm_mday,
-                         mon_names[t->tm_mon],
-                         t->tm_year + 1900,
-                         t->tm_hour,
-                         t->tm_min,
-                         t->tm_sec);
-    out.swap(f);
-}
\ No newline at end of file
+    // <day-name>, <DD> <month> <YYYY> <hh>:<mm>:<ss> GMT
+    auto two = [](char *p, int v) {
+        p[0] = static_cast<char>('0' + v / 10);
+        p[1] = static_cast<char>('0' + v % 10);
+    };
+    int year = t->tm_year + 1900;
+    memcpy(out, day_names[t->tm_wday], 3);
+    out[3] = ',', out[4] = ' ';
+    two(out + 5, t->tm_mday);
+    out[7] = ' ';
+    memcpy(out + 8, mon_names[t->tm_mon], 3);
+    out[11] = ' ';
+    two(out + 12, year / 100 % 100);
+    two(out + 14, year % 100);
+    out[16] = ' ';
+    two(out + 17, t->tm_hour);
+    out[19] = ':';
+    two(out + 20, t->tm_min);
+    out[22] = ':';
+    two(out + 23, t->tm_sec);
+    memcpy(out + 25, " GMT", 4);
+}
@@ -0,0 +1,107 @@
+#include "mime.h"
+#include "whs-internal.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+
+using namespace whs;
+using whs::mime::Table;
+
+std::string_view mime::extension(std::string_view name)
+{
+    auto dot = name.find_last_of("./");
+    if (dot == std::string_view::npos || name[dot] == '/') {
+        return {};
+    }
+    return name.substr(dot + 1);
+}
+
+std::string_view mime::find(std::string_view ext)
+{
+    auto i = builtinHash.find(ext);
+    if (i < 0 || !utils::iequals(builtin[i].extension, ext)) {
+        return default_type;
+    }
+    return builtin[i].type;
+}
+
+Table::Table() : entries(std::begin(builtin), std::end(builtin))
+{
+    rebuild();
+}
+
+void Table::rebuild()
+{
+    // shaped as the builtin hash: slots at most half used, a bucket for 2 keys on average
+    size_t slots = 16;
+    while (slots < entries.size() * 2) {
+        slots <<= 1;
+    }
+    for (;; slots <<= 1) {
+        index.slots.assign(slots, -1);
+        index.seeds.assign(slots / 4, 0);
+        if (index.build(entries.data(), entries.size())) {
+            return;
+        }
+    }
+}
+
+bool Table::load(const std::string& file)
+{
+    std::ifstream in(file);
+    if (!in) {
+        logger::error(fmt::format("mime: open {} failed: {}", file, strerror(errno)));
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        auto hash = line.find('#');
+        if (hash != std::string::npos) {
+            line.resize(hash);
+        }
+        std::istringstream words(line);
+        std::string type, ext;
+        if (!(words >> type)) {
+            continue;
+        }
+        std::string_view stored;
+        while (words >> ext) {
+            if (stored.empty()) {
+                stored = strings.copy(type);
+            }
+            auto same = std::find_if(entries.begin(), entries.end(), [&ext](const entry& e) {
+                return utils::iequals(e.extension, ext);
+            });
+            if (same != entries.end()) {
+                same->type = stored;
+            } else {
+                entries.push_back({strings.copy(ext), stored});
+            }
+        }
+    }
+    rebuild();
+    return true;
+}
+
+std::string_view Table::type_of(std::string_view name) const
+{
+    auto ext = extension(name);
+    if (ext.empty()) {
+        return default_type;
+    }
+    auto i = index.find(ext);
+    if (i < 0 || !utils::iequals(entries[i].extension, ext)) {
+        return default_type;
+    }
+    return entries[i].type;
+}
+
+void Table::swap(Table& another)
+{
+    strings.swap(another.strings);
+    entries.swap(another.entries);
+    std::swap(index, another.index);
+}
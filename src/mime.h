@@ -0,0 +1,235 @@
+#ifndef WHS_MIME_H
+#define WHS_MIME_H
+
+#include "whs/entity.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace whs::mime
+{
+    struct entry {
+        std::string_view extension;
+        std::string_view type;
+    };
+
+    constexpr std::string_view default_type = "application/octet-stream";
+
+    // FNV-1a of the ASCII lowercased key, finished with the murmur3 mixer
+    constexpr uint32_t hash(std::string_view key, uint32_t seed)
+    {
+        uint32_t h = 2166136261u ^ (seed * 0x9E3779B9u);
+        for (char c : key) {
+            if (c >= 'A' && c <= 'Z') {
+                c += 'a' - 'A';
+            }
+            h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        h ^= h >> 16;
+        h *= 0x85EBCA6Bu;
+        h ^= h >> 13;
+        h *= 0xC2B2AE35u;
+        return h ^ (h >> 16);
+    }
+
+    /**
+     * @brief minimal collision-free map from extensions to entry indexes (CHD).
+     *
+     * Keys are grouped in buckets by hash(key, 0). A bucket holds the seed of a second hash
+     * sending each of its keys to a slot of its own, so a lookup is two hashes and one compare
+     * with the entry found. Fixed size arrays build it at compile time, vectors at runtime.
+     */
+    template <class Slots, class Seeds>
+    struct PerfectHash {
+        Slots slots;  // index of the entry, -1 if free. A power of two in size
+        Seeds seeds;  // per bucket
+        bool ok;
+
+        constexpr size_t slot(std::string_view key) const
+        {
+            auto seed = seeds[hash(key, 0) % seeds.size()];
+            return hash(key, seed) & (slots.size() - 1);
+        }
+
+        // index of the only entry `key' may be, -1 if none
+        constexpr int find(std::string_view key) const
+        {
+            return slots[slot(key)];
+        }
+
+        /**
+         * @brief place `count' entries, largest buckets first. `slots' and `seeds' must be
+         * sized already.
+         * @return false if some bucket found no seed, with more slots it will. Extensions must be
+         * unique ignoring case, or it never does
+         */
+        constexpr bool build(const entry *entries, size_t count)
+        {
+            for (auto &s : slots) {
+                s = -1;
+            }
+            for (auto &s : seeds) {
+                s = 0;
+            }
+            auto bucket = [&](size_t i) { return hash(entries[i].extension, 0) % seeds.size(); };
+            size_t largest = 0;
+            for (size_t b = 0; b < seeds.size(); ++b) {
+                size_t n = 0;
+                for (size_t i = 0; i < count; ++i) {
+                    n += bucket(i) == b;
+                }
+                largest = n > largest ? n : largest;
+            }
+            for (size_t n = largest; n > 0; --n) {
+                for (size_t b = 0; b < seeds.size(); ++b) {
+                    size_t size = 0;
+                    for (size_t i = 0; i < count; ++i) {
+                        size += bucket(i) == b;
+                    }
+                    if (size == n && !place(entries, count, b, bucket)) {
+                        return ok = false;
+                    }
+                }
+            }
+            return ok = true;
+        }
+
+    private:
+        template <class Bucket>
+        constexpr bool place(const entry *entries, size_t count, size_t b, Bucket bucket)
+        {
+            for (uint32_t seed = 1; seed < 0x10000; ++seed) {
+                seeds[b] = seed;
+                size_t i = 0;
+                for (; i < count; ++i) {
+                    if (bucket(i) != b) {
+                        continue;
+                    }
+                    auto &s = slots[slot(entries[i].extension)];
+                    if (s != -1) {
+                        break;
+                    }
+                    s = i;
+                }
+                if (i == count) {
+                    return true;
+                }
+                // undo the keys of `b' placed before the collision
+                for (size_t j = 0; j < i; ++j) {
+                    if (bucket(j) == b) {
+                        slots[slot(entries[j].extension)] = -1;
+                    }
+                }
+            }
+            return false;
+        }
+    };
+
+    // types of the builtin table, lowercase and unique extensions
+    // clang-format off
+    inline constexpr entry builtin[] = {
+        {"war", "application/java-archive"},    {"jar", "application/java-archive"},
+        {"ear", "application/java-archive"},    {"js", "application/javascript"},
+        {"json", "application/json"},           {"hqx", "application/mac-binhex40"},
+        {"doc", "application/msword"},          {"so", "application/octet-stream"},
+        {"msp", "application/octet-stream"},    {"msm", "application/octet-stream"},
+        {"msi", "application/octet-stream"},    {"iso", "application/octet-stream"},
+        {"img", "application/octet-stream"},    {"exe", "application/octet-stream"},
+        {"dmg", "application/octet-stream"},    {"dll", "application/octet-stream"},
+        {"deb", "application/octet-stream"},    {"bin", "application/octet-stream"},
+        {"pdf", "application/pdf"},             {"ps", "application/postscript"},
+        {"eps", "application/postscript"},      {"ai", "application/postscript"},
+        {"rtf", "application/rtf"},             {"m3u8", "application/vnd.apple.mpegurl"},
+        {"kml", "application/vnd.google-earth.kml+xml"},
+        {"kmz", "application/vnd.google-earth.kmz"},
+        {"xls", "application/vnd.ms-excel"},
+        {"eot", "application/vnd.ms-fontobject"},
+        {"ppt", "application/vnd.ms-powerpoint"},
+        {"odg", "application/vnd.oasis.opendocument.graphics"},
+        {"odp", "application/vnd.oasis.opendocument.presentation"},
+        {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+        {"odt", "application/vnd.oasis.opendocument.text"},
+        {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+        {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+        {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+        {"wmlc", "application/vnd.wap.wmlc"},       {"7z", "application/x-7z-compressed"},
+        {"cco", "application/x-cocoa"},             {"jardiff", "application/x-java-archive-diff"},
+        {"jnlp", "application/x-java-jnlp-file"},   {"run", "application/x-makeself"},
+        {"pm", "application/x-perl"},               {"pl", "application/x-perl"},
+        {"prc", "application/x-pilot"},             {"pdb", "application/x-pilot"},
+        {"rar", "application/x-rar-compressed"},    {"rpm", "application/x-redhat-package-manager"},
+        {"sea", "application/x-sea"},               {"swf", "application/x-shockwave-flash"},
+        {"sit", "application/x-stuffit"},           {"tk", "application/x-tcl"},
+        {"tcl", "application/x-tcl"},               {"pem", "application/x-x509-ca-cert"},
+        {"der", "application/x-x509-ca-cert"},      {"crt", "application/x-x509-ca-cert"},
+        {"xpi", "application/x-xpinstall"},         {"xhtml", "application/xhtml+xml"},
+        {"xspf", "application/xspf+xml"},           {"zip", "application/zip"},
+        {"midi", "audio/midi"},     {"mid", "audio/midi"},      {"kar", "audio/midi"},
+        {"mp3", "audio/mpeg"},      {"ogg", "audio/ogg"},       {"m4a", "audio/x-m4a"},
+        {"ra", "audio/x-realaudio"}, {"woff", "font/woff"},     {"woff2", "font/woff2"},
+        {"gif", "image/gif"},       {"jpg", "image/jpeg"},      {"jpeg", "image/jpeg"},
+        {"png", "image/png"},       {"svgz", "image/svg+xml"},  {"svg", "image/svg+xml"},
+        {"tiff", "image/tiff"},     {"tif", "image/tiff"},      {"wbmp", "image/vnd.wap.wbmp"},
+        {"webp", "image/webp"},     {"ico", "image/x-icon"},    {"jng", "image/x-jng"},
+        {"bmp", "image/x-ms-bmp"},  {"css", "text/css"},        {"shtml", "text/html"},
+        {"html", "text/html"},     {"htm", "text/html"},       {"txt", "text/plain"},
+        {"xml", "text/xml"},        {"asf", "video/3gpp"},      {"ts", "video/mp2t"},
+        {"mp4", "video/mp4"},       {"mpg", "video/mpeg"},      {"mpeg", "video/mpeg"},
+        {"mov", "video/quicktime"}, {"webm", "video/webm"},     {"flv", "video/x-flv"},
+        {"m4v", "video/x-m4v"},     {"mng", "video/x-mng"},     {"asx", "video/x-ms-asf"},
+        {"wmv", "video/x-ms-wmv"},  {"avi", "video/x-msvideo"}
+    };
+    // clang-format on
+
+    inline constexpr auto builtinHash = [] {
+        PerfectHash<std::array<int16_t, 256>, std::array<uint16_t, 64>> h{};
+        h.build(builtin, std::size(builtin));
+        return h;
+    }();
+    static_assert(builtinHash.ok, "no seed places some bucket of the builtin types");
+
+    // extension of a file name, empty if it has none
+    std::string_view extension(std::string_view name);
+
+    // builtin type of an extension, default_type if unknown
+    std::string_view find(std::string_view extension);
+
+    /**
+     * @brief the builtin types overridden by mime.types files, in the same kind of hash.
+     *
+     * Loading rebuilds the hash, lookups must not run meanwhile.
+     */
+    class Table : utils::noncopyable
+    {
+        utils::arena strings;  // of loaded entries
+        std::vector<entry> entries;
+        PerfectHash<std::vector<int32_t>, std::vector<uint32_t>> index;
+
+        void rebuild();
+
+    public:
+        Table();
+
+        /**
+         * @brief add the types of a mime.types file: lines of a type followed by its
+         * extensions, '#' starts a comment. A listed extension takes the type of its last line.
+         * @return false if `file' is unreadable
+         */
+        bool load(const std::string &file);
+
+        // type of a file name, by its extension. default_type if unknown
+        std::string_view type_of(std::string_view name) const;
+
+        size_t size() const
+        {
+            return entries.size();
+        }
+
+        void swap(Table &);
+    };
+}  // namespace whs::mime
+
+#endif
@@ -0,0 +1,185 @@
+#include "whs-internal.h"
+#include "whs/task.h"
+
+#include <exception>
+#include <mutex>
+
+using namespace whs;
+
+namespace
+{
+    /**
+     * @brief Offload: runs a handler on WorkerPool::shared(), the request suspended meanwhile.
+     *
+     * The job lives in the request arena. Once the handler returned, the worker posts it back to
+     * the reactor of the connection, which resumes the request.
+     */
+    class Offload : public Middleware
+    {
+        Middleware *handler;
+
+#ifdef ENABLE_LIBUV
+        struct Job : utils::Posted {
+            const Middleware *handler;
+            Request *req;
+            utils::Reactor *reactor;
+            utils::root done;
+            std::exception_ptr error;
+        };
+
+        // on a worker
+        static void work(utils::Posted *p)
+        {
+            auto job = static_cast<Job *>(p);
+            try {
+                (*job->handler)(*job->req, *job->done.resp);
+            } catch (...) {
+                job->error = std::current_exception();
+            }
+            job->run = finish;
+            LibuvWhs::post(job->reactor, job);
+        }
+
+        // back on the loop
+        static void finish(utils::Posted *p)
+        {
+            auto job = static_cast<Job *>(p);
+            // the arena is reset once the request resumed
+            auto done = job->done;
+            auto error = std::move(job->error);
+            job->~Job();
+            utils::complete(&done, std::move(error));
+        }
+#endif
+
+    public:
+        explicit Offload(Middleware *m) : handler(m) {}
+
+        virtual ~Offload()
+        {
+            delete handler;
+        }
+
+        virtual bool operator()(Request &req, Response &resp) const THROWS override
+        {
+#ifdef ENABLE_LIBUV
+            if (auto r = LibuvWhs::current()) {
+                auto job = new (req.allocate(sizeof(Job), alignof(Job))) Job;
+                job->run = work;
+                job->handler = handler;
+                job->req = &req;
+                job->reactor = r;
+                job->done = {req.suspend(), &resp};
+                LibuvWhs::expect(r);
+                utils::WorkerPool::shared().submit(job);
+                return true;
+            }
+#endif
+            return (*handler)(req, resp);
+        }
+    };
+}  // namespace
+
+Middleware *route::HttpRouteBuilder::offloaded(Middleware *ware)
+{
+    return new Offload(ware);
+}
+
+void Whs::setOffloadThreads(unsigned int count)
+{
+#ifdef ENABLE_LIBUV
+    utils::WorkerPool::sharedSize = count;
+#else
+    (void)count;
+#endif
+}
+
+#ifdef ENABLE_LIBUV
+using utils::WorkerPool;
+
+std::atomic<unsigned int> WorkerPool::sharedSize(0);
+
+WorkerPool &WorkerPool::shared()
+{
+    static WorkerPool pool(sharedSize != 0 ? sharedSize.load()
+                                           : std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+WorkerPool::WorkerPool(size_t count)
+    : queues(new Queue[count]), next(0), queued(0), sleeping(0), stopping(false)
+{
+    for (size_t i = 0; i < count; ++i) {
+        threads.emplace_back([this, i] { work(i); });
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<mutex> guard(idle);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+void WorkerPool::submit(Posted *job)
+{
+    auto &q = queues[next.fetch_add(1, std::memory_order_relaxed) % threads.size()];
+    job->next = nullptr;
+    {
+        std::lock_guard<mutex> guard(q.m);
+        if (q.tail == nullptr) {
+            q.head = job;
+        } else {
+            q.tail->next = job;
+        }
+        q.tail = job;
+    }
+    // pairs with the check of `queued' by a worker going to sleep
+    queued.fetch_add(1);
+    if (sleeping.load() != 0) {
+        std::lock_guard<mutex> guard(idle);
+        wake.notify_one();
+    }
+}
+
+utils::Posted *WorkerPool::take(size_t self)
+{
+    for (size_t i = 0; i < threads.size(); ++i) {
+        auto &q = queues[(self + i) % threads.size()];
+        std::lock_guard<mutex> guard(q.m);
+        if (auto job = q.head) {
+            q.head = job->next;
+            if (q.head == nullptr) {
+                q.tail = nullptr;
+            }
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+void WorkerPool::work(size_t self)
+{
+    for (;;) {
+        if (auto job = take(self)) {
+            job->run(job);
+            continue;
+        }
+        std::unique_lock<mutex> guard(idle);
+        sleeping.fetch_add(1);
+        while (queued.load() == 0 && !stopping) {
+            wake.wait(guard);
+        }
+        sleeping.fetch_sub(1);
+        if (stopping && queued.load() == 0) {
+            return;
+        }
+    }
+}
+#endif
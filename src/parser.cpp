@@ -29,51 +29,20 @@ static constexpr http_parser_settings settings = {.on_message_begin = hpcb::onMe
                                                   .on_chunk_header = hpcb::onChunkerHeader,
                                                   .on_chunk_complete = hpcb::onChunkComplete};
 
-namespace
-{
-    // parseQueryString: split URL queries into map
-    //                   query parameter should begin at char_('?')
-}  // namespace
-
-
 namespace whs::httpParserCallbacks
 {
-    void setCurrent(HttpParser* hp, const vector<char>& cs)
-    {
-        hp->setCurrentHeaderField(string(cs.cbegin(), cs.cend()));
-    }
-
-    void setCurrentQuery(HttpParser* hp, const vector<char>& cs)
-    {
-        string value(cs.cbegin(), cs.cend());
-        hp->setQuery(std::move(value));
-    }
-
-    int onMessageBegin(http_parser*)
+    int onMessageBegin(http_parser* p)
     {
+        HttpParser* hp = (HttpParser*)(p->data);
+        hp->beginMessage();
         return 0;
     }
 
     int onURL(http_parser* p, const char* at, size_t l)
     {
         HttpParser* hp = (HttpParser*)(p->data);
-        string url(at, l);
-        const auto pos = url.find_first_of('?');
-        if (pos == string::npos) {
-            hp->setBaseURL(move(url));
-            return 0;
-        } else {
-            hp->setBaseURL(url.substr(0, pos));
-            string query(url.substr(pos));
-            std::map<std::string, std::string> dict;
-            auto status = utils::parseQueryString(query, dict);
-            for (const auto& k : dict) {
-                std::string name(k.first);
-                std::string value(k.second);
-                hp->current.emplaceQuery(std::move(name), std::move(value));
-            }
-            return status ? 0 : 1;
-        }
+        hp->url = hp->token(hp->url, at, l, HttpParser::_Token::URL);
+        return 0;
     }
 
     int onStatus(http_parser*, const char*, size_t)
@@ -86,16 +55,15 @@ namespace whs::httpParserCallbacks
     int onHeaderField(http_parser* p, const char* at, size_t l)
     {
         HttpParser* hp = (HttpParser*)(p->data);
-        string header(at, l);
-        std::for_each(header.begin(), header.end(), [](char& c) { c = std::tolower(c); });
-        hp->setCurrentHeaderField(std::move(header));
+        hp->currentHeaderField =
+            hp->token(hp->currentHeaderField, at, l, HttpParser::_Token::FIELD);
         return 0;
     }
 
     int onHeaderValue(http_parser* p, const char* at, size_t l)
     {
         HttpParser* hp = (HttpParser*)(p->data);
-        hp->setCurrentHeaderValue(string(at, l));
+        hp->headerValue(at, l);
         return 0;
     }
 
@@ -111,12 +79,14 @@ namespace whs::httpParserCallbacks
     {
         HttpParser* hp = (HttpParser*)(p->data);
         hp->current.setMethod(p->method);
+        hp->finishURL();
         return 0;
     }
 
     int onMessageComplete(http_parser* p)
     {
         HttpParser* hp = (HttpParser*)(p->data);
+        hp->inMessage = false;
         hp->finishCurrentRequest();
         return 0;
     }
@@ -135,40 +105,148 @@ namespace whs::httpParserCallbacks
 
 HttpParser::HttpParser(Client* c) : _client(c)
 {
+    current._client = c;
+    _inputBegin = _inputEnd = nullptr;
     parser.data = this;
     http_parser_init(&parser, HTTP_REQUEST);
     bodyLength = 0;
+    lastToken = _Token::NONE;
+    inMessage = false;
+}
+
+void HttpParser::beginMessage()
+{
+    // the body of the previous request goes with it
+    _buf.clear();
+    current.reset();
+    inMessage = true;
+    lastToken = _Token::NONE;
+    url = currentHeaderField = string_view();
+}
+
+bool HttpParser::shrink(size_t limit)
+{
+    bool body = _buf.shrink(limit);
+    return current._arena.shrink(limit) || body;
+}
+
+void HttpParser::headerValue(const char* at, size_t l)
+{
+    auto& headers = current._headers;
+    if (lastToken == _Token::VALUE) {
+        headers.back().second = token(headers.back().second, at, l, _Token::VALUE);
+    } else {
+        headers.emplace_back(currentHeaderField, token(string_view(), at, l, _Token::VALUE));
+    }
+}
+
+string_view HttpParser::token(string_view prev, const char* at, size_t l, _Token t)
+{
+    string_view ret(at, l);
+    if (lastToken == t) {
+        ret = current._arena.append(prev, ret);
+    }
+    lastToken = t;
+    return ret;
+}
+
+void HttpParser::finishURL()
+{
+    const auto pos = url.find_first_of('?');
+    current._baseURL = url.substr(0, pos);
+    if (pos != string_view::npos) {
+        current._queryString = url.substr(pos + 1);
+    }
+    url = string_view();
+}
+
+void HttpParser::pin(const char* begin, const char* end)
+{
+    auto& arena = current._arena;
+    auto move = [&](string_view& v) {
+        if (v.data() >= begin && v.data() < end) {
+            v = arena.copy(v);
+        }
+    };
+    move(url);
+    move(currentHeaderField);
+    move(current._baseURL);
+    move(current._queryString);
+    for (auto& h : current._headers) {
+        move(h.first);
+        move(h.second);
+    }
+    // routing and queries may have run already
+    for (auto& p : current._params) {
+        move(p.second);
+    }
+    for (auto& q : current._queries) {
+        move(q.first);
+        move(q.second);
+    }
+}
+
+void HttpParser::hold()
+{
+    pin(_inputBegin, _inputEnd);
+}
+
+void HttpParser::resume() THROWS
+{
+    http_parser_pause(&parser, 0);
+    std::string held;
+    held.swap(_held);
+    if (!held.empty()) {
+        // an empty buffer would tell http_parser the connection reached EOF
+        readFromNetwork(held.data(), held.size());
+    }
 }
 
 void HttpParser::finishCurrentRequest()
 {
     if (bodyLength > 0) {
-        char* buf = new char[(bodyLength + 1)];
-        buf[bodyLength] = 0;
-        _buf.read(buf, bodyLength);
-        assert((size_t)_buf.gcount() == bodyLength);
-        assert(_buf);
-        current.setBody(buf, bodyLength);
-
-        buf = nullptr;
+        // the request points into `_buf', which is kept until the next message begins
+        const char nul = 0;
+        _buf.write(&nul, 1);
+        assert(_buf.stored() == bodyLength + 1);
+        current._body = _buf.data();
+        current._bodySize = bodyLength;
         bodyLength = 0;
     }
     if (_client) {
-        Response resp;
-        _client->processing_request(current, resp);
-        _client->write_response(resp);
+        _client->processing_request(current);
+        if (current.isSuspended()) {
+            // later messages are parsed once it resumes
+            http_parser_pause(&parser, 1);
+        }
     }
 }
 
 bool HttpParser::readFromNetwork(const char* buf, int size) THROWS
 {
-    bool status = (int)http_parser_execute(&parser, &settings, buf, size) == size;
+    if (current.isSuspended()) {
+        _held.append(buf, size);
+        return true;
+    }
+    _inputBegin = buf;
+    _inputEnd = buf + size;
+    auto parsed = http_parser_execute(&parser, &settings, buf, size);
+    _inputBegin = _inputEnd = nullptr;
+    if (HTTP_PARSER_ERRNO(&parser) == HPE_PAUSED) {
+        _held.assign(buf + parsed, size - parsed);
+        return true;
+    }
+    bool status = (int)parsed == size;
 
     if (!status) {
         auto eno = HTTP_PARSER_ERRNO(&parser);
         auto msg = http_errno_description(static_cast<http_errno>(eno));
         throw HttpParserException(parser.http_errno, msg);
     }
+    if (inMessage) {
+        // the rest of this message arrives in another buffer
+        pin(buf, buf + size);
+    }
 
     return status;
 }
@@ -203,8 +281,8 @@ bool route::NotFoundException::buildResponse(char*& ptr, size_t& size) const
     }
     p[0] = ' ', p[1] = 't', p[2] = 'o', p[3] = ' ', p += 3;
 
-    for (auto url = _req.getBaseURL().c_str(); *url; ++p, ++url) {
-        *p = *url;
+    for (auto c : _req.getBaseURL()) {
+        *p++ = c;
     }
     p[0] = '.', p[1] = 0, p += 1;
     size = p - ptr;
@@ -215,12 +293,16 @@ void HttpParser::reset()
 {
     http_parser_init(&parser, HTTP_REQUEST);
     bodyLength = 0;
-    Request req;
-    current.swap(req);
+    _buf.clear();
+    current.reset();
+    _held.clear();
+    lastToken = _Token::NONE;
+    inMessage = false;
+    url = currentHeaderField = string_view();
 }
 
 
-route::NotFoundException::NotFoundException(const Request& req, const std::string& url)
+route::NotFoundException::NotFoundException(const Request& req, std::string_view url)
     : HttpException(std::string("Not Found exception: ")
                         .append(http_method_str(static_cast<http_method>(req.getMethod())))
                         .append(" to ")
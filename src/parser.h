@@ -22,10 +22,6 @@ namespace whs
         int onMessageComplete(http_parser*);
         int onChunkerHeader(http_parser*);
         int onChunkComplete(http_parser*);
-
-        void setCurrent(HttpParser*, const std::vector<char>&);
-        void setCurrentQuery(HttpParser*, const std::vector<char>&);
-
     }  // namespace httpParserCallbacks
 
     class HttpParser
@@ -43,28 +39,50 @@ namespace whs
         friend int httpParserCallbacks::onChunkerHeader(http_parser*);
         friend int httpParserCallbacks::onChunkComplete(http_parser*);
 
-        friend void httpParserCallbacks::setCurrent(HttpParser*, const std::vector<char>&);
-        friend void httpParserCallbacks::setCurrentQuery(HttpParser*, const std::vector<char>&);
+        // kind of the last token delivered by http_parser. A token is only split at the end of
+        // an input buffer, so a callback of the same kind continues the previous token.
+        enum class _Token { NONE, URL, FIELD, VALUE };
 
         size_t bodyLength;
+        // body of the current message, in one piece: the request points into it
         whsutils::MemoryBuffer _buf;
         http_parser parser;
 
         Client* _client;
 
+        // URL, header names and values of `current' are views into the buffer passed to
+        // readFromNetwork. A request is processed before readFromNetwork returns, so they are
+        // only copied (into the request arena) when a message spans more than one read, or
+        // the request is suspended.
         RestfulHttpRequest current;
 
-        std::string currentHeaderField;
+        // the buffer being parsed
+        const char* _inputBegin;
+        const char* _inputEnd;
+        // bytes received after a suspended request, parsed when it resumes
+        std::string _held;
 
-        void setQuery(std::string&& value)
-        {
-            current.emplaceQuery(std::move(currentHeaderField), std::move(value));
-        }
+        _Token lastToken;
+        bool inMessage;
+        std::string_view url;
+        std::string_view currentHeaderField;
 
-        void setBaseURL(std::string&& value)
-        {
-            current.setBaseURL(value);
-        }
+        void beginMessage();
+
+        void headerValue(const char*, size_t);
+
+        std::string_view token(std::string_view prev, const char*, size_t, _Token);
+
+        void finishURL();
+
+        // copy every view of the current message pointing into [begin, end) to the arena
+        void pin(const char* begin, const char* end);
+
+        // `current' is suspended: pin it to the arena
+        void hold();
+
+        // `current' resumed and completed: parse what was held meanwhile
+        void resume() THROWS;
 
     public:
         bool shouldCloseConnection() const
@@ -77,20 +95,6 @@ namespace whs
             return current;
         }
 
-        void setCurrentHeaderValue(std::string&& v)
-        {
-            current.emplaceHeader(move(currentHeaderField), move(v));
-        }
-
-        void setCurrentHeaderField(std::string&& f)
-        {
-            currentHeaderField = f;
-            std::transform(currentHeaderField.begin(),
-                           currentHeaderField.begin(),
-                           currentHeaderField.end(),
-                           [](auto c) { return tolower(c); });
-        }
-
         HttpParser(Client* = nullptr);
 
         bool readFromNetwork(const char*, int) THROWS;
@@ -98,6 +102,9 @@ namespace whs
         void finishCurrentRequest();
 
         void reset();
+
+        // after reset(): free the buffers a large message grew over `limit' bytes. Whether it did
+        bool shrink(size_t limit);
     };
 }  // namespace whs
 
@@ -4,6 +4,7 @@
 
 
 whs::Pipeline::Pipeline(const PipelineBuilder& b)
+    : fused(b._fused), fusedSize(b._fused == nullptr ? 0 : b._fused->size())
 {
     auto _wares = b._wares;
     auto c = _wares.size();
@@ -14,7 +15,7 @@ whs::Pipeline::Pipeline(const PipelineBuilder& b)
     this->wares[c] = nullptr;
 }
 
-whs::Pipeline::Pipeline()
+whs::Pipeline::Pipeline() : fused(nullptr), fusedSize(0)
 {
     wares = new Middleware*[1];
     wares[0] = nullptr;
@@ -22,6 +23,7 @@ whs::Pipeline::Pipeline()
 
 whs::Pipeline::~Pipeline()
 {
+    delete fused;
     if (wares != nullptr) {
         for (auto first = wares; *first != nullptr; ++first) {
             delete *first;
@@ -1,5 +1,6 @@
 #include "whs/entity.h"
 #include "whs-internal.h"
+#include "client.h"
 
 using namespace whs;
 
@@ -11,9 +12,11 @@ using namespace whs;
  */
 RestfulHttpRequest::RestfulHttpRequest()
 {
-    _cookies = _params = _queries = nullptr;
+    _queriesParsed = false;
     _body = nullptr;
     _method = _bodySize = 0;
+    _client = nullptr;
+    _suspended = false;
 }
 
 /**
@@ -23,30 +26,28 @@ RestfulHttpRequest::RestfulHttpRequest()
  */
 RestfulHttpRequest::RestfulHttpRequest(RestfulHttpRequest&& req)
 {
-    _cookies = req._cookies;
-    _params = req._params;
-    _queries = req._queries;
+    _params.swap(req._params);
+    _queries.swap(req._queries);
+    _queriesParsed = req._queriesParsed;
     _body = req._body;
+    _bodySize = req._bodySize;
     _headers.swap(req._headers);
-    _baseURL.swap(req._baseURL);
+    _baseURL = req._baseURL;
+    _queryString = req._queryString;
     _method = req._method;
-    req._queries = req._params = req._cookies = nullptr;
+    process_data.swap(req.process_data);
+    _arena.swap(req._arena);
+    _client = nullptr;
+    _suspended = false;
+    req._queriesParsed = false;
+    req._body = nullptr;
+    req._bodySize = 0;
 }
 /**
  * @brief Destroy the Restful Http Request:: Restful Http Request object
  *
  */
-RestfulHttpRequest::~RestfulHttpRequest()
-{
-    if (_cookies)
-        delete _cookies;
-    if (_params)
-        delete _params;
-    if (_queries)
-        delete _queries;
-    if (_body)
-        delete[](_body);
-}
+RestfulHttpRequest::~RestfulHttpRequest() {}
 /**
  * @brief swap utility for RestfulHttpRequest
  *
@@ -54,15 +55,85 @@ RestfulHttpRequest::~RestfulHttpRequest()
  */
 void RestfulHttpRequest::swap(RestfulHttpRequest& req)
 {
-    std::swap(_cookies, req._cookies);
-    std::swap(_queries, req._queries);
-    std::swap(_params, req._params);
+    _queries.swap(req._queries);
+    std::swap(_queriesParsed, req._queriesParsed);
+    _params.swap(req._params);
     std::swap(_method, req._method);
     std::swap(_body, req._body);
+    std::swap(_bodySize, req._bodySize);
+    std::swap(_baseURL, req._baseURL);
+    std::swap(_queryString, req._queryString);
 
     process_data.swap(req.process_data);
     _headers.swap(req._headers);
-    _baseURL.swap(req._baseURL);
+    _arena.swap(req._arena);
+}
+
+/**
+ * @brief suspend the pipelines after the running stage
+ *
+ * @return Resume continuing them
+ */
+Resume RestfulHttpRequest::suspend()
+{
+    assert(_client != nullptr && !_suspended);
+    _suspended = true;
+    // the read buffer is released once the stage returns
+    _client->hold();
+    return Resume(_client);
+}
+
+void RestfulHttpRequest::pin()
+{
+    if (_client != nullptr) {
+        _client->hold();
+    }
+}
+
+/**
+ * @brief forget the current request, keeping allocated capacity for the next one
+ *
+ */
+void RestfulHttpRequest::reset()
+{
+    _params.clear();
+    _queries.clear();
+    _queriesParsed = false;
+    _body = nullptr;
+    _method = _bodySize = 0;
+    _baseURL = _queryString = std::string_view();
+    _headers.clear();
+    process_data.clear();
+    _arena.reset();
+    _suspended = false;
+}
+
+/**
+ * @brief set the request body
+ *
+ * @param buf body, allocated with new[]. Copied into the request, then deleted
+ * @param size
+ */
+void RestfulHttpRequest::setBody(char* buf, size_t size)
+{
+    auto body = _arena.allocate(size + 1);
+    memcpy(body, buf, size);
+    body[size] = 0;
+    delete[] buf;
+    _body = body;
+    _bodySize = size;
+}
+
+/**
+ * @brief split and decode the query string, once
+ *
+ */
+void RestfulHttpRequest::parseQueries() const
+{
+    if (!_queriesParsed) {
+        _queriesParsed = true;
+        utils::parseQueryString(_queryString, _arena, _queries);
+    }
 }
 
 /**
@@ -75,10 +146,29 @@ void RestfulHttpRequest::swap(RestfulHttpRequest& req)
  */
 bool RestfulHttpRequest::getQuery(const std::string& qname, std::string& out) const
 {
-    if (_queries) {
-        const auto& found = _queries->find(qname);
-        if (found != _queries->end()) {
-            out = found->second;
+    std::string_view sv;
+    if (getQuery(std::string_view(qname), sv)) {
+        out.assign(sv);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief check and get Query without copying
+ *
+ * @param qname query name, percent-decoded
+ * @param out   query value, percent-decoded, points into the request. Note: Please check return
+ * value before accessing to this parameter
+ * @return true success
+ * @return false query `qname' not found in queries. `out' parameter is undefined
+ */
+bool RestfulHttpRequest::getQuery(std::string_view qname, std::string_view& out) const
+{
+    parseQueries();
+    for (const auto& entry : _queries) {
+        if (entry.first == qname) {
+            out = entry.second;
             return true;
         }
     }
@@ -92,24 +182,23 @@ bool RestfulHttpRequest::getQuery(const std::string& qname, std::string& out) co
  */
 int RestfulHttpRequest::getQueryCount() const
 {
-    if (_queries)
-        return _queries->size();
-    else
-        return 0;
+    parseQueries();
+    return static_cast<int>(_queries.size());
 }
 
 /**
- * @brief put new URL query key-value pair into RestfulHttpRequest
+ * @brief put new URL query key-value pair into RestfulHttpRequest. An existing query is not
+ * replaced.
  *
  * @param first KEY
  * @param second VALUE
  */
 void RestfulHttpRequest::emplaceQuery(std::string&& first, std::string&& second)
 {
-    if (_queries == nullptr) {
-        _queries = utils::createMap();
+    std::string_view v;
+    if (!getQuery(std::string_view(first), v)) {
+        _queries.emplace_back(_arena.copy(first), _arena.copy(second));
     }
-    _queries->emplace(first, second);
 }
 
 /**
@@ -119,10 +208,11 @@ void RestfulHttpRequest::emplaceQuery(std::string&& first, std::string&& second)
  */
 void RestfulHttpRequest::removeParam(std::string&& name)
 {
-    assert(_params != nullptr);
-    auto find = _params->find(name);
-    if (find != _params->end()) {
-        _params->erase(find);
+    for (auto it = _params.begin(); it != _params.end(); ++it) {
+        if (it->first == name) {
+            _params.erase(it);
+            return;
+        }
     }
 }
 /**
@@ -132,10 +222,7 @@ void RestfulHttpRequest::removeParam(std::string&& name)
  */
 size_t RestfulHttpRequest::getParamsCount() const
 {
-    if (_params == nullptr)
-        return 0;
-    else
-        return _params->size();
+    return _params.size();
 }
 /**
  * @brief get param key-value pair
@@ -147,32 +234,43 @@ size_t RestfulHttpRequest::getParamsCount() const
  */
 bool RestfulHttpRequest::getParam(const std::string& p, std::string& v) const
 {
-    if (_params == nullptr) {
-        return false;
-    } else {
-        const auto& find = _params->find(p);
-        if (find == _params->end()) {
-            return false;
-        } else {
-            v = find->second;
+    std::string_view sv;
+    if (getParam(std::string_view(p), sv)) {
+        v.assign(sv);
+        return true;
+    }
+    return false;
+}
+/**
+ * @brief get param without copying
+ *
+ * @param p param name
+ * @param v param value, points into the request. Note: Please check return value before accessing
+ * to this parameter.
+ * @return true param whose name is `p' found.
+ * @return false not found
+ */
+bool RestfulHttpRequest::getParam(std::string_view p, std::string_view& v) const
+{
+    for (const auto& entry : _params) {
+        if (entry.first == p) {
+            v = entry.second;
             return true;
         }
     }
+    return false;
 }
 /**
- * @brief add param key-value pair
+ * @brief add param key-value pair. An existing param is not replaced.
  *
  * @param name param name
  * @param value param value
  */
 void RestfulHttpRequest::addParam(const std::string& name, const std::string& value)
 {
-    if (_params == nullptr) {
-        _params = utils::createMap();
-    }
-    auto find = _params->find(name);
-    if (find == _params->end()) {
-        _params->emplace((std::string(name)), std::string(value));
+    std::string_view v;
+    if (!getParam(std::string_view(name), v)) {
+        _params.emplace_back(_arena.copy(name), _arena.copy(value));
     }
 }
 
@@ -184,13 +282,32 @@ void RestfulHttpRequest::addParam(const std::string& name, const std::string& va
  * @return true
  * @return false
  */
-bool RestfulHttpRequest::getHeader(const std::string& h, std::string& v)
+bool RestfulHttpRequest::getHeader(const std::string& h, std::string& v) const
 {
-    auto find = _headers.find(h);
-    if (find == _headers.end()) {
-        return false;
-    } else {
-        v = find->second;
+    std::string_view sv;
+    if (getHeader(std::string_view(h), sv)) {
+        v.assign(sv);
         return true;
     }
+    return false;
+}
+
+/**
+ * @brief get Http Header without copying
+ *
+ * @param h header name, case-insensitive
+ * @param v header value, points into the request. Note: Please check return value before accessing
+ * this parameter.
+ * @return true
+ * @return false
+ */
+bool RestfulHttpRequest::getHeader(std::string_view h, std::string_view& v) const
+{
+    for (const auto& entry : _headers) {
+        if (utils::iequals(entry.first, h)) {
+            v = entry.second;
+            return true;
+        }
+    }
+    return false;
 }
@@ -1,7 +1,13 @@
 #include "whs/entity.h"
 #include "whs-internal.h"
 
+#include "fmt/format.h"
+
+#include <cerrno>
 #include <cmath>
+#include <cstring>
+#include <functional>
+#include <unistd.h>
 
 using namespace whs;
 using namespace std;
@@ -63,76 +69,191 @@ namespace
         return buf;
     }
 
-    size_t calcHttpResponseSize(const RestfulHttpResponse::ResponseHeaderMapType& hs,
-                                size_t otherBytes)
+    // read a file chunk into `p', zeros where the file is shorter than expected
+    size_t readFile(char* p, const BodyChunk& c)
     {
-        size_t size = 0;
-
-        size = 8 + 1 +  // HTTP/1.1<space>
-               3 + 1 +  // status code<space>
-               32 +     // status code string (The longest status code string is 31 bytes)
-               2;       // \r\n
-
-        for (const auto& entry : hs) {
-            // <header field>: <header value>\r\n
-            //               12               3 4
-            size += entry.first.length() + entry.second.length() + 4;
+        size_t done = 0;
+        while (done < c.size) {
+            auto n = pread(c.fd, p + done, c.size - done, c.offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                logger::error(fmt::format("response: read of body file failed: {}",
+                                          n == 0 ? "unexpected end of file" : strerror(errno)));
+                memset(p + done, 0, c.size - done);
+                break;
+            }
+            done += n;
         }
-        size += 2;  // \r\n at end of HTTP package header
-        if (otherBytes > 0) {
-            size += (otherBytes + 2);  // body end \r\n
-        }
-
-        return size;
+        return c.size;
     }
 }  // namespace
 
 
 /// RestfulHttpResponse functions
 
-RestfulHttpResponse::HeaderName::HeaderName(HeaderName&& h)
+RestfulHttpResponse::RestfulHttpResponse(RestfulHttpResponse&& o)
 {
-    store = h.store;
-    assert(h.store != _Store::NONE);
-    if (store == _Store::STRING) {
-        name.hname = h.name.hname;
-    } else {
-        name.cheader = h.name.cheader;
+    _status = o._status;
+    _end = o._end;
+    _deferred = o.takeDeferred();
+
+    // views into `o._inline' move with the bytes, the others stay where they are
+    _inlineUsed = o._inlineUsed;
+    memcpy(_inline, o._inline, _inlineUsed);
+    _overflow.swap(o._overflow);
+    auto rebase = [this, &o](_View v) {
+        std::less<const char*> before;
+        if (v.data() == nullptr || before(v.data(), o._inline)
+            || !before(v.data(), o._inline + _inlineBytes)) {
+            return v;
+        }
+        return _View(_inline + (v.data() - o._inline), v.size());
+    };
+    _commonSet = o._commonSet;
+    for (size_t i = 0; i < utils::CommonHeaderCount; ++i) {
+        _common[i] = rebase(o._common[i]);
+    }
+    _customCount = o._customCount;
+    for (size_t i = 0; i < _customCount; ++i) {
+        _custom[i] = std::make_pair(rebase(o._custom[i].first), rebase(o._custom[i].second));
+    }
+    _moreCustom.swap(o._moreCustom);
+    for (auto& c : _moreCustom) {
+        c = std::make_pair(rebase(c.first), rebase(c.second));
+    }
+    _rawHeaderCount = o._rawHeaderCount;
+    for (size_t i = 0; i < _rawHeaderCount; ++i) {
+        _rawHeaders[i] = rebase(o._rawHeaders[i]);
     }
-    h.store = _Store::NONE;
+    _moreRawHeaders.swap(o._moreRawHeaders);
+    for (auto& v : _moreRawHeaders) {
+        v = rebase(v);
+    }
+
+    _bodySize = o._bodySize;
+    _chunkCount = o._chunkCount;
+    for (size_t i = 0; i < _chunkCount; ++i) {
+        _chunks[i] = o._chunks[i];
+    }
+    _moreChunks.swap(o._moreChunks);
+    o._chunkCount = 0;
+    o._moreChunks.clear();
+    o._bodySize = 0;
+    o._status = 0;
+    o._commonSet = 0;
+    o._customCount = 0;
+    o._moreCustom.clear();
+    o._inlineUsed = 0;
+    o._rawHeaderCount = 0;
+    o._moreRawHeaders.clear();
 }
 
+void RestfulHttpResponse::reset()
+{
+    dropBody();
+    delete _deferred;
+    _deferred = nullptr;
+    _status = 0;
+    _end = false;
+    _commonSet = 0;
+    _customCount = 0;
+    _moreCustom.clear();
+    _inlineUsed = 0;
+    _overflow.reset();
+    _rawHeaderCount = 0;
+    _moreRawHeaders.clear();
+}
 
-bool RestfulHttpResponse::HeaderName::operator<(const HeaderName& h) const
+bool RestfulHttpResponse::shrink(size_t limit)
 {
-    assert(h.store != _Store::NONE);
-    assert(store != _Store::NONE);
-    if (h.store == store) {
-        if (h.store == _Store::ENUM) {
-            return name.cheader < h.name.cheader;
-        } else {
-            return *name.hname < (*h.name.hname);
+    return _overflow.shrink(limit);
+}
+
+std::string_view RestfulHttpResponse::store(std::string_view v)
+{
+    if (v.size() <= _inlineBytes - _inlineUsed) {
+        auto p = _inline + _inlineUsed;
+        memcpy(p, v.data(), v.size());
+        _inlineUsed += v.size();
+        return std::string_view(p, v.size());
+    }
+    return _overflow.copy(v);
+}
+
+std::string_view* RestfulHttpResponse::find(std::string_view name)
+{
+    utils::CommonHeader h;
+    if (utils::findCommonHeader(name, h)) {
+        return find(h);
+    }
+    for (size_t i = 0; i < _customCount; ++i) {
+        if (utils::iequals(_custom[i].first, name)) {
+            return &_custom[i].second;
+        }
+    }
+    for (auto& c : _moreCustom) {
+        if (utils::iequals(c.first, name)) {
+            return &c.second;
         }
-    } else {
-        const auto& first = to_string();
-        const auto& second = h.to_string();
-        return first < second;
     }
+    return nullptr;
 }
 
-void RestfulHttpResponse::setBody(const char* buf, size_t size)
+std::string_view& RestfulHttpResponse::slot(std::string_view name)
+{
+    utils::CommonHeader h;
+    if (utils::findCommonHeader(name, h)) {
+        return slot(h);
+    }
+    auto found = find(name);
+    if (found != nullptr) {
+        return *found;
+    }
+    if (_customCount < _inlineCustom) {
+        _custom[_customCount] = std::make_pair(store(name), std::string_view());
+        return _custom[_customCount++].second;
+    }
+    _moreCustom.emplace_back(store(name), std::string_view());
+    return _moreCustom.back().second;
+}
+
+void RestfulHttpResponse::setContentLength(size_t size)
 {
     char buffer[24] = {0};
+    this->operator[](utils::CommonHeader::ContentLength) = itoa(buffer, size);
+}
 
-    auto& type = this->operator[](utils::CommonHeader::ContentType);
+void RestfulHttpResponse::dropBody()
+{
+    takeBody([](const BodyChunk& c) {
+        if (c.release != nullptr) {
+            c.release(c);
+        }
+    });
+}
+
+void RestfulHttpResponse::setBody(const char* buf, size_t size)
+{
+    auto type = this->operator[](utils::CommonHeader::ContentType);
     if (type.empty()) {
         type = "text/plain";
     }
 
-    addHeader(utils::CommonHeader::ContentLength, string(itoa(buffer, size)));
+    dropBody();
+    appendBody({buf, size, [](const BodyChunk& c) { delete[] c.data; }, nullptr});
+}
 
-    _body = buf;
-    _bodySize = size;
+void RestfulHttpResponse::appendBody(const BodyChunk& c)
+{
+    if (_chunkCount < _inlineChunks) {
+        _chunks[_chunkCount++] = c;
+    } else {
+        _moreChunks.push_back(c);
+    }
+    _bodySize += c.size;
+    setContentLength(_bodySize);
 }
 
 
@@ -142,18 +263,43 @@ void RestfulHttpResponse::setBody(const char* buf, size_t size)
     } while (false)
 
 
-void RestfulHttpResponse::toBytes(char** ptr, size_t& size)
+size_t RestfulHttpResponse::prepareHead()
 {
-    auto& cl = this->operator[](utils::CommonHeader::ContentLength);
-    if (_bodySize == 0 && cl == "") {
-        static char zero[] = "0";
-        cl = zero;
+    auto cl = this->operator[](utils::CommonHeader::ContentLength);
+    if (_bodySize == 0 && cl.empty()) {
+        cl = "0";
     }
-    auto allocSize = calcHttpResponseSize(_headers, _bodySize) + 5;
 
-    char* p = *ptr = new char[(allocSize)];
-    char* end = p + allocSize;
+    size_t size = 8 + 1 +  // HTTP/1.1<space>
+                  3 + 1 +  // status code<space>
+                  strlen(http_status_str(static_cast<enum http_status>(_status))) +
+                  2 +  // \r\n
+                  2;   // \r\n at end of HTTP package header
+    // <header field>: <header value>\r\n
+    //               12               3 4
+    for (size_t i = 0; i < utils::CommonHeaderCount; ++i) {
+        if ((_commonSet >> i & 1) != 0) {
+            size += utils::mapCommonHeader(static_cast<utils::CommonHeader>(i)).length()
+                    + _common[i].length() + 4;
+        }
+    }
+    for (size_t i = 0; i < _customCount; ++i) {
+        size += _custom[i].first.length() + _custom[i].second.length() + 4;
+    }
+    for (const auto& c : _moreCustom) {
+        size += c.first.length() + c.second.length() + 4;
+    }
+    for (size_t i = 0; i < _rawHeaderCount; ++i) {
+        size += _rawHeaders[i].size();
+    }
+    for (const auto& v : _moreRawHeaders) {
+        size += v.size();
+    }
+    return size;
+}
 
+char* RestfulHttpResponse::writeHead(char* p) const
+{
     {
         // http version
         const char http[] = "HTTP/1.1 ";
@@ -179,29 +325,58 @@ void RestfulHttpResponse::toBytes(char** ptr, size_t& size)
         _LINEEND;
     }
 
-    for (const auto& entry : _headers) {
-        const string& hname = entry.first;
-        for (const char* name = hname.c_str(); *name; ++p, ++name) {
-            *p = *name;
-        }
-
+    auto header = [&p](std::string_view name, std::string_view value) {
+        memcpy(p, name.data(), name.size());
+        p += name.size();
         p[0] = ':', p[1] = ' ';
         p += 2;
-
-        for (const char* value = entry.second.c_str(); *value; ++p, ++value) {
-            *p = *value;
-        }
+        memcpy(p, value.data(), value.size());
+        p += value.size();
         _LINEEND;
+    };
+    for (size_t i = 0; i < utils::CommonHeaderCount; ++i) {
+        if ((_commonSet >> i & 1) != 0) {
+            header(utils::mapCommonHeader(static_cast<utils::CommonHeader>(i)), _common[i]);
+        }
+    }
+    for (size_t i = 0; i < _customCount; ++i) {
+        header(_custom[i].first, _custom[i].second);
+    }
+    for (const auto& c : _moreCustom) {
+        header(c.first, c.second);
+    }
+
+    for (size_t i = 0; i < _rawHeaderCount; ++i) {
+        memcpy(p, _rawHeaders[i].data(), _rawHeaders[i].size());
+        p += _rawHeaders[i].size();
+    }
+    for (const auto& v : _moreRawHeaders) {
+        memcpy(p, v.data(), v.size());
+        p += v.size();
     }
 
     _LINEEND;
+    return p;
+}
 
-    assert(end - p > _bodySize);
-    if (_bodySize > 0) {
-        memcpy(p, _body, _bodySize);
-        p += _bodySize;
-        // _LINEEND;
-    }
+void RestfulHttpResponse::toBytes(char** ptr, size_t& size)
+{
+    auto headSize = prepareHead();
+    size = headSize + _bodySize;
+
+    char* p = *ptr = new char[size];
+    p = writeHead(p);
+    assert(static_cast<size_t>(p - *ptr) == headSize);
 
-    size = p - *ptr;
-}
\ No newline at end of file
+    takeBody([&p](const BodyChunk& c) {
+        if (c.fd == -1) {
+            memcpy(p, c.data, c.size);
+            p += c.size;
+        } else {
+            p += readFile(p, c);
+        }
+        if (c.release != nullptr) {
+            c.release(c);
+        }
+    });
+}
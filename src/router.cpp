@@ -1,5 +1,11 @@
 #include "whs/entity.h"
 #include "whs-internal.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <bitset>
+#include <functional>
+#include <memory>
 
 using std::string;
 using namespace whs;
@@ -9,44 +15,311 @@ using builder = route::HttpRouteBuilder;
 using mp = MiddlewarePointer;
 using hr = route::HttpRouter;
 
+hr::Result hr::dispatch(Request& req, Response& resp) const THROWS
+{
+    const auto& next = GetRoute(req, req.getBaseURL());
+    if (!next) {
+        return NOT_FOUND;
+    }
+    return next->operator()(req, resp) ? PASSED : STOPPED;
+}
+
 bool hr::operator()(Request& req, Response& resp) const THROWS
 {
-    auto& url = req.getBaseURL();
-    const auto& next = GetRoute(req, url);
-    if (next) {
-        return next->operator()(req, resp);
-    } else {
+    auto result = dispatch(req, resp);
 #ifdef ENABLE_EXCEPTIONS
-        throw NotFoundException(req, url);
-#else
-        return false;
+    if (result == NOT_FOUND) {
+        throw NotFoundException(req, req.getBaseURL());
+    }
 #endif
+    return result == PASSED;
+}
+
+const mp hr::emptyMiddleware(nullptr);
+
+const mp& hr::GetRoute(Request& req, std::string_view url) const
+{
+    RadixTree::ParamList params;
+    size_t count = 0;
+    auto found = start == nullptr ? nullptr : start->find(url, req.getMethod(), params, count);
+    if (found == nullptr) {
+        return emptyMiddleware;
     }
+    for (size_t i = 0; i < count; ++i) {
+        req._params.emplace_back(params[i].name,
+                                 std::string_view(params[i].value, params[i].length));
+    }
+    return *found;
 }
 
-HttpRouteNode::~HttpRouteNode()
+/**
+ * @brief routes are added one by one into a pointer-based radix tree, which is then laid out
+ * breadth-first into a RadixTree, so that children of a node are contiguous.
+ */
+class RadixTree::Compiler
+{
+    struct Node {
+        bool param = false;
+        std::string label;    // static label, or param name
+        std::string pattern;  // param segment as written: {name} or {name:regex}
+        utils::regex* constraint = nullptr;
+        bool trailingSlash = false;
+        std::vector<std::pair<int, mp>> handlers;
+        std::vector<std::unique_ptr<Node>> children;
+    };
+
+    Node root;
+    std::vector<std::unique_ptr<utils::regex>> regexes;
+
+    Node* insertStatic(Node*, std::string_view);
+    Node* insertParam(Node*, const std::string&);
+
+public:
+    /**
+     * @brief add a route.
+     * @param prefix URL prefix of the router
+     * @param segments path segments, '/' excluded. A segment {...} is a param.
+     * @param method http method
+     * @param func handler
+     */
+    void add(std::string_view prefix,
+             const std::vector<const std::string*>& segments,
+             int method,
+             mp func);
+
+    RadixTree* compile();
+};
+
+RadixTree::Compiler::Node* RadixTree::Compiler::insertStatic(Node* n, std::string_view s)
 {
-    for (int i = 0; i < _childrenCount; i++) {
-        delete *(_children + i);
+    while (!s.empty()) {
+        size_t i = 0;
+        for (; i < n->children.size(); ++i) {
+            const auto& c = n->children[i];
+            if (!c->param && c->label[0] == s[0]) {
+                break;
+            }
+        }
+        if (i == n->children.size()) {
+            auto child = std::make_unique<Node>();
+            child->label = s;
+            n->children.push_back(std::move(child));
+            return n->children.back().get();
+        }
+
+        auto& child = n->children[i];
+        size_t common = 1;
+        while (common < s.size() && common < child->label.size()
+               && s[common] == child->label[common]) {
+            ++common;
+        }
+        if (common < child->label.size()) {
+            // split the child at the end of the common part
+            auto mid = std::make_unique<Node>();
+            mid->label = child->label.substr(0, common);
+            child->label.erase(0, common);
+            mid->children.push_back(std::move(child));
+            child = std::move(mid);
+        }
+        n = child.get();
+        s.remove_prefix(common);
     }
-    delete[] _children;
+    return n;
 }
 
-HttpRouteStringNode::~HttpRouteStringNode() {}
+RadixTree::Compiler::Node* RadixTree::Compiler::insertParam(Node* n, const std::string& segment)
+{
+    for (auto& c : n->children) {
+        if (c->param && c->pattern == segment) {
+            return c.get();
+        }
+    }
+    auto child = std::make_unique<Node>();
+    utils::regex regex;
+    bool s = utils::parseParam(segment, child->label, regex);
+    assert(s);
+    (void)s;
+    child->param = true;
+    child->pattern = segment;
+    // {name} accepts any segment, don't run a regex for it
+    if (segment.find(':') != std::string::npos) {
+        regexes.emplace_back(new utils::regex(std::move(regex)));
+        child->constraint = regexes.back().get();
+    }
+    n->children.push_back(std::move(child));
+    return n->children.back().get();
+}
 
-HttpRouteParamNode::HttpRouteParamNode(const std::string& pn, utils::regex&& regex) : _paramName(pn)
+void RadixTree::Compiler::add(std::string_view prefix,
+                              const std::vector<const std::string*>& segments,
+                              int method,
+                              mp func)
 {
-    _regex = new utils::regex(std::move(regex));
+    assert(method >= 0 && method < 64);
+    string text(prefix);
+    text.push_back('/');
+    Node* n = &root;
+    size_t params = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const auto& segment = *segments[i];
+        if (i != 0) {
+            text.push_back('/');
+        }
+        if (utils::isParam(segment)) {
+            n = insertParam(insertStatic(n, text), segment);
+            text.clear();
+            ++params;
+        } else {
+            text.append(segment);
+        }
+    }
+    n = insertStatic(n, text);
+    if (params > MAX_PARAMS) {
+        logger::error(
+            fmt::format("whs-core: route with more than {} params ignored", MAX_PARAMS));
+        return;
+    }
+    // a route with segments tolerates a trailing '/', as /a/ for /a. The route '/' does not.
+    n->trailingSlash = n->trailingSlash || !segments.empty();
+    for (const auto& h : n->handlers) {
+        if (h.first == method) {
+            // the first route added for a path and method wins
+            return;
+        }
+    }
+    n->handlers.emplace_back(method, func);
 }
 
-HttpRouteParamNode::~HttpRouteParamNode()
+RadixTree* RadixTree::Compiler::compile()
 {
-    if (_regex != nullptr) {
-        delete _regex;
+    auto tree = new RadixTree;
+    std::vector<const Node*> order;
+
+    auto append = [&](const Node* n) {
+        RadixTree::Node node{};
+        node.param = n->param;
+        node.trailingSlash = n->trailingSlash;
+        node.constraint = n->constraint;
+        node.label = static_cast<uint32_t>(tree->strings.size());
+        node.labelLength = static_cast<uint32_t>(n->label.size());
+        tree->strings.append(n->label);
+
+        auto handlers = n->handlers;
+        std::sort(handlers.begin(), handlers.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+        node.handler = static_cast<uint32_t>(tree->handlers.size());
+        for (const auto& h : handlers) {
+            node.methods |= uint64_t(1) << h.first;
+            tree->handlers.push_back(h.second);
+        }
+
+        tree->nodes.push_back(node);
+        tree->firstBytes.push_back(n->param || n->label.empty() ? '\0' : n->label[0]);
+        order.push_back(n);
+    };
+
+    append(&root);
+    for (size_t i = 0; i < order.size(); ++i) {
+        const Node* n = order[i];
+        auto first = static_cast<uint32_t>(tree->nodes.size());
+        uint32_t statics = 0, params = 0;
+        for (const auto& c : n->children) {
+            if (!c->param) {
+                append(c.get());
+                ++statics;
+            }
+        }
+        for (const auto& c : n->children) {
+            if (c->param) {
+                append(c.get());
+                ++params;
+            }
+        }
+        auto& node = tree->nodes[i];
+        node.firstChild = first;
+        node.staticCount = statics;
+        node.paramCount = params;
+    }
+
+    for (auto& r : regexes) {
+        tree->regexes.push_back(r.release());
     }
+    regexes.clear();
+    return tree;
 }
 
-const mp hr::emptyMiddleware(nullptr);
+RadixTree::~RadixTree()
+{
+    for (auto r : regexes) {
+        delete r;
+    }
+}
+
+const mp* RadixTree::find(std::string_view url, int method, ParamList& params, size_t& count) const
+{
+    count = 0;
+    if (nodes.empty()) {
+        return nullptr;
+    }
+    return match(nodes[0], url.data(), url.data() + url.length(), method, params, count);
+}
+
+const mp* RadixTree::match(const Node& node,
+                           const char* p,
+                           const char* end,
+                           int method,
+                           ParamList& params,
+                           size_t& count) const
+{
+    if (node.param) {
+        // a param is one segment, empty only if not the last one: /p//c matches /p/{a}/c
+        if (p == end || count == MAX_PARAMS) {
+            return nullptr;
+        }
+        auto segEnd = static_cast<const char*>(memchr(p, '/', end - p));
+        if (segEnd == nullptr) {
+            segEnd = end;
+        }
+        if (node.constraint != nullptr && !node.constraint->match(p, segEnd - p)) {
+            return nullptr;
+        }
+        params[count++] = {std::string_view(strings.data() + node.label, node.labelLength),
+                           p,
+                           static_cast<size_t>(segEnd - p)};
+        p = segEnd;
+    } else {
+        if (static_cast<size_t>(end - p) < node.labelLength
+            || memcmp(p, strings.data() + node.label, node.labelLength) != 0) {
+            return nullptr;
+        }
+        p += node.labelLength;
+    }
+
+    const mp* ret = nullptr;
+    if (p != end) {
+        const Node* children = nodes.data() + node.firstChild;
+        if (node.staticCount != 0) {
+            auto bytes = firstBytes.data() + node.firstChild;
+            auto hit = static_cast<const char*>(memchr(bytes, *p, node.staticCount));
+            if (hit != nullptr) {
+                ret = match(children[hit - bytes], p, end, method, params, count);
+            }
+        }
+        for (uint32_t i = 0; ret == nullptr && i < node.paramCount; ++i) {
+            ret = match(children[node.staticCount + i], p, end, method, params, count);
+        }
+    }
+    if (ret == nullptr && (p == end || (node.trailingSlash && p + 1 == end && *p == '/'))
+        && method >= 0 && method < 64 && (node.methods >> method & 1) != 0) {
+        auto below = node.methods & ((uint64_t(1) << method) - 1);
+        ret = &handlers[node.handler + std::bitset<64>(below).count()];
+    }
+    if (ret == nullptr && node.param) {
+        --count;
+    }
+    return ret;
+}
 
 builder::HttpRouteBuilder()
 {
@@ -56,49 +329,24 @@ builder::HttpRouteBuilder()
     root->type = TreeNodeType::URL_ROOT;
 }
 
-HttpRouteRootNode* builder::build()
-{
-    HttpRouteRootNode* root = new HttpRouteRootNode(this->root->_myNodeName);
-    HttpRouteBuilder::buildTreeNode(this->root, root);
-    return root;
-}
-
-void builder::buildTreeNode(TreeNode* bnode, HttpRouteNode* rnode)
+RadixTree* builder::build()
 {
-    auto children = bnode->_children;
-    auto size = children.size();
-    rnode->_childrenCount = size;
-    rnode->_children = new HttpRouteNode*[size];
-    for (size_t i = 0; i < size; i++) {
-        auto c = children[i];
-        HttpRouteNode* node = nullptr;
-        switch (c->type) {
-            case TreeNodeType::URL_QUERY_SEGMENT: {
-                std::string pn;
-                utils::regex regex;
-                bool s = utils::parseParam(c->_myNodeName, pn, regex);
-                assert(s);
-                auto nParam = new HttpRouteParamNode(pn, std::move(regex));
-                node = nParam;
-            } break;
-            case TreeNodeType::URL_STRING_SEGMENT: {
-                auto nString = new HttpRouteStringNode(c->_myNodeName);
-                node = nString;
-            } break;
-            case TreeNodeType::URL_SEGMENT_END: {
-                assert(c->func != nullptr);
-                HttpRouteEndNode* end = new HttpRouteEndNode(c->func);
-                end->method = c->method;
-                node = end;
-                break;
-            } break;
-            case TreeNodeType::URL_ROOT:
-                assert(false);
-                break;
+    RadixTree::Compiler compiler;
+    std::vector<const std::string*> segments;
+    // depth-first in insertion order, so params of a node are tried in the order they were added
+    std::function<void(const TreeNode*)> walk = [&](const TreeNode* n) {
+        for (auto c : n->_children) {
+            if (c->type == TreeNodeType::URL_SEGMENT_END) {
+                compiler.add(root->_myNodeName, segments, c->method, c->func);
+            } else {
+                segments.push_back(&c->_myNodeName);
+                walk(c);
+                segments.pop_back();
+            }
         }
-        *(rnode->_children + i) = node;
-        buildTreeNode(c, node);
-    }
+    };
+    walk(root);
+    return compiler.compile();
 }
 
 
@@ -135,106 +383,6 @@ void builder::insertChild(
     insertChild(method, ins, begin + 1, end, m, name);
 }
 
-HttpRouteRootNode::HttpRouteRootNode(const string& myName) : HttpRouteStringNode(myName) {}
-
-const mp& HttpRouteRootNode::GetRoute(Request& req, const string& url) const
-{
-    const char* p = url.c_str();
-    const char* end = p + url.length();
-    return getRoute(req, p, end);
-}
-
-const mp& HttpRouteStringNode::getRoute(Request& req,
-                                        const char* current,
-                                        const char* end) const THROWS
-{
-    if (current >= end) {
-        return HttpRouter::emptyMiddleware;
-    } else {
-        for (const char* my = _nodeName.c_str(); *my; ++my, ++current) {
-            if (current == end) {
-                return HttpRouter::emptyMiddleware;
-            }
-            if (*my != *current) {
-                return HttpRouter::emptyMiddleware;
-            }
-        }
-        if (*current != '/' && *current != '\0') {
-            return hr::emptyMiddleware;
-        }
-        for (int i = 0; i < _childrenCount; i++) {
-            auto& existInChildren = _children[i]->getRoute(req, current + 1, end);
-            if (existInChildren) {
-                return existInChildren;
-            }
-        }
-    }
-    return hr::emptyMiddleware;
-}
-
-const mp& HttpRouteRootNode::getRoute(Request& req,
-                                      const char* current,
-                                      const char* end) const THROWS
-{
-    if (!_nodeName.empty()) {
-        for (const char* my = _nodeName.c_str(); *my; ++my, ++current) {
-            if (current == end) {
-                return HttpRouter::emptyMiddleware;
-            }
-            if (*my != *current) {
-                return HttpRouter::emptyMiddleware;
-            }
-        }
-    }
-    if (*current == '/') {
-        // prefix check success
-        for (int i = 0; i < _childrenCount; i++) {
-            auto& existInChildren = _children[i]->getRoute(req, current + 1, end);
-            if (existInChildren) {
-                return existInChildren;
-            }
-        }
-    }
-    return hr::emptyMiddleware;
-}
-
-const mp& HttpRouteEndNode::getRoute(Request& req,
-                                     const char* current,
-                                     const char* end) const THROWS
-{
-    if (current >= end && req.getMethod() == method) {
-        return func;
-    }
-    return hr::emptyMiddleware;
-}
-
-const mp& HttpRouteParamNode::getRoute(Request& req,
-                                       const char* current,
-                                       const char* end) const THROWS
-{
-    if (current >= end) {
-        return hr::emptyMiddleware;
-    } else {
-        auto partend = current;
-        for (; *partend != '/' && *partend && partend < end; ++partend) {
-        }
-        string param(current, partend);
-
-        if (_regex->match(param)) {
-            for (int i = 0; i < _childrenCount; i++) {
-                auto n = partend + 1;
-                auto& existInChildren = _children[i]->getRoute(req, n, end);
-                if (existInChildren) {
-                    req.addParam(_paramName, param);
-                    return existInChildren;
-                }
-            }
-        }
-    }
-    return hr::emptyMiddleware;
-}
-
-
 void hr::swap(hr& other)
 {
     std::swap(start, other.start);
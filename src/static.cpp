@@ -9,9 +9,12 @@
 #include <sys/types.h>
 #include <stack>
 #include <dirent.h>
-#include <openssl/md5.h>
 #include <fcntl.h>
-#include <random>
+#include <cinttypes>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <chrono>
+#include <optional>
 using namespace whs;
 
 #ifndef UNIX_HAVE_EPOLL
@@ -28,89 +31,118 @@ using namespace whs;
 
 namespace
 {
-    static std::random_device rd;
+    constexpr uint32_t watchMask = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE
+                                   | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
 
-    auto next_rand()
+    void closeFile(const BodyChunk& c)
     {
-        return rd();
+        close(c.fd);
     }
 
-    struct ftype {
-        const char* name;
-        const char* mime;
-    };
+    void releaseCached(const BodyChunk& c)
+    {
+        utils::FileCache::release(static_cast<utils::FileCache::Entry*>(c.arg));
+    }
+
+    // body and pre-serialized headers of a cached file
+    void sendCached(Response& resp, utils::FileCache::Entry* e)
+    {
+        resp.addRawHeaders(e->head);
+        resp.appendBody({e->body.data(), e->body.size(), releaseCached, e});
+    }
 
-    static const char* default_mime = "application/octet-stream";
-    // clang-format off
-    static const ftype  mime_type[] = {
-        {"war", "application/java-archive"},    {"jar", "application/java-archive"},
-        {"ear", "application/java-archive"},    {"js", "application/javascript"},
-        {"json", "application/json"},           {"hqx", "application/mac-binhex40"},
-        {"doc", "application/msword"},          {"so", "application/octet-stream"},
-        {"msp", "application/octet-stream"},    {"msm", "application/octet-stream"},
-        {"msi", "application/octet-stream"},    {"iso", "application/octet-stream"},
-        {"img", "application/octet-stream"},    {"exe", "application/octet-stream"},
-        {"dmg", "application/octet-stream"},    {"dll", "application/octet-stream"},
-        {"deb", "application/octet-stream"},    {"bin", "application/octet-stream"},
-        {"pdf", "application/pdf"},             {"ps", "application/postscript"},
-        {"eps", "application/postscript"},      {"ai", "application/postscript"},
-        {"rtf", "application/rtf"},             {"m3u8", "application/vnd.apple.mpegurl"},
-        {"kml", "application/vnd.google-earth.kml+xml"},
-        {"kmz", "application/vnd.google-earth.kmz"},
-        {"xls", "application/vnd.ms-excel"},
-        {"eot", "application/vnd.ms-fontobject"},
-        {"ppt", "application/vnd.ms-powerpoint"},
-        {"odg", "application/vnd.oasis.opendocument.graphics"},
-        {"odp", "application/vnd.oasis.opendocument.presentation"},
-        {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
-        {"odt", "application/vnd.oasis.opendocument.text"},
-        {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
-        {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
-        {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
-        {"wmlc", "application/vnd.wap.wmlc"},       {"7z", "application/x-7z-compressed"},
-        {"cco", "application/x-cocoa"},             {"jardiff", "application/x-java-archive-diff"},
-        {"jnlp", "application/x-java-jnlp-file"},   {"run", "application/x-makeself"},
-        {"pm", "application/x-perl"},               {"pl", "application/x-perl"},
-        {"prc", "application/x-pilot"},             {"pdb", "application/x-pilot"},
-        {"rar", "application/x-rar-compressed"},    {"rpm", "application/x-redhat-package-manager"},
-        {"sea", "application/x-sea"},               {"swf", "application/x-shockwave-flash"},
-        {"sit", "application/x-stuffit"},           {"tk", "application/x-tcl"},
-        {"tcl", "application/x-tcl"},               {"pem", "application/x-x509-ca-cert"},
-        {"der", "application/x-x509-ca-cert"},      {"crt", "application/x-x509-ca-cert"},
-        {"xpi", "application/x-xpinstall"},         {"xhtml", "application/xhtml+xml"},
-        {"xspf", "application/xspf+xml"},           {"zip", "application/zip"},
-        {"midi", "audio/midi"},     {"mid", "audio/midi"},      {"kar", "audio/midi"},
-        {"mp3", "audio/mpeg"},      {"ogg", "audio/ogg"},       {"m4a", "audio/x-m4a"},
-        {"ra", "audio/x-realaudio"}, {"woff", "font/woff"},     {"woff2", "font/woff2"},
-        {"gif", "image/gif"},       {"jpg", "image/jpeg"},      {"jpeg", "image/jpeg"},
-        {"png", "image/png"},       {"svgz", "image/svg+xml"},  {"svg", "image/svg+xml"},
-        {"tiff", "image/tiff"},     {"tif", "image/tiff"},      {"wbmp", "image/vnd.wap.wbmp"},
-        {"webp", "image/webp"},     {"ico", "image/x-icon"},    {"jng", "image/x-jng"},
-        {"bmp", "image/x-ms-bmp"},  {"css", "text/css"},        {"shtml", "text/html"},
-        {"html", "text/html"},     {"htm", "text/html"},       {"txt", "text/plain"},
-        {"xml", "text/xml"},        {"asf", "video/3gpp"},      {"ts", "video/mp2t"},
-        {"mp4", "video/mp4"},       {"mpg", "video/mpeg"},      {"mpeg", "video/mpeg"},
-        {"mov", "video/quicktime"}, {"webm", "video/webm"},     {"flv", "video/x-flv"},
-        {"m4v", "video/x-m4v"},     {"mng", "video/x-mng"},     {"asx", "video/x-ms-asf"},
-        {"wmv", "video/x-ms-wmv"},  {"avi", "video/x-msvideo"}
+    // content codings of precompressed siblings, in order of preference
+    struct encoding {
+        std::string_view suffix;
+        std::string_view token;
     };
-    // clang-format on
+    constexpr encoding encodings[] = {{".br", "br"}, {".zst", "zstd"}, {".gz", "gzip"}};
 
-    const char* search_mime(const char* name)
+    // cache key of a precompressed sibling sent as an encoding of the original, which needs
+    // other headers than the sibling requested by its own name
+    inline uint64_t encodedKey(uint64_t key)
     {
-        for (const auto& f : mime_type) {
-            if (0 == strcmp(f.name, name)) {
-                return f.mime;
+        return key ^ 0x9E3779B97F4A7C15ULL;
+    }
+
+    void releaseArray(const BodyChunk& c)
+    {
+        delete[] c.data;
+    }
+
+    /**
+     * @brief a 206 body of `ranges', from the cached entry `e' if not nullptr, else from the
+     * file `rd'. Takes `rd': the last chunk reading it closes it. Several ranges are sent as
+     * multipart/byteranges parts separated by `boundary'.
+     */
+    void sendRanges(Response& resp,
+                    const std::vector<utils::ByteRange>& ranges,
+                    uint64_t size,
+                    std::string_view mime,
+                    std::string_view boundary,
+                    utils::FileCache::Entry* e,
+                    int rd)
+    {
+        auto slice = [e, rd](const utils::ByteRange& r) {
+            size_t length = r.last - r.first + 1;
+            if (e != nullptr) {
+                return BodyChunk{e->body.data() + r.first,
+                                 length,
+                                 releaseCached,
+                                 utils::FileCache::retain(e)};
+            }
+            BodyChunk c = {nullptr, length, nullptr, nullptr};
+            c.fd = rd;
+            c.offset = r.first;
+            return c;
+        };
+        auto text = [](const std::string& s) {
+            return BodyChunk{
+                utils::dup_memory(s.data(), s.size()), s.size(), releaseArray, nullptr};
+        };
+
+        std::vector<BodyChunk> chunks;
+        if (ranges.size() == 1) {
+            const auto& r = ranges.front();
+            resp.addHeader(utils::CommonHeader::ContentType, mime);
+            resp.addHeader("Content-Range", fmt::format("bytes {}-{}/{}", r.first, r.last, size));
+            chunks.push_back(slice(r));
+        } else {
+            resp.addHeader(utils::CommonHeader::ContentType,
+                           fmt::format("multipart/byteranges; boundary={}", boundary));
+            for (const auto& r : ranges) {
+                chunks.push_back(text(fmt::format("{}--{}\r\nContent-Type: {}\r\n"
+                                                  "Content-Range: bytes {}-{}/{}\r\n\r\n",
+                                                  &r == &ranges.front() ? "" : "\r\n",
+                                                  boundary,
+                                                  mime,
+                                                  r.first,
+                                                  r.last,
+                                                  size)));
+                chunks.push_back(slice(r));
             }
+            chunks.push_back(text(fmt::format("\r\n--{}--\r\n", boundary)));
         }
-        return default_mime;
+        if (e == nullptr) {
+            // chunks are released in order, each once sent
+            for (auto c = chunks.rbegin(); c != chunks.rend(); ++c) {
+                if (c->fd != -1) {
+                    c->release = closeFile;
+                    break;
+                }
+            }
+        }
+        for (const auto& c : chunks) {
+            resp.appendBody(c);
+        }
+        resp.status(HTTP_STATUS_PARTIAL_CONTENT);
     }
 }  // namespace
 
 uint32_t StaticFileServer::file::major_time = 0;
 
 StaticFileServer::StaticFileServer(const std::string& prefix, const std::string& local)
-    : fd(0), path(local), prefix(prefix)
+    : fd(0), path(local), prefix(prefix), stopFd(-1)
 {
     auto ct = time(nullptr);
     file::major_time = ct >> 32;
@@ -121,14 +153,19 @@ StaticFileServer::StaticFileServer(const std::string& prefix, const std::string&
 
 StaticFileServer::StaticFileServer(StaticFileServer&& another)
 {
+    assert(!another.watcher.joinable());
+    stopFd = -1;
     fd = another.fd;
     another.fd = 0;
     path.swap((another.path));
     prefix.swap(another.prefix);
+    etagIndex.swap(another.etagIndex);
+    types.swap(another.types);
 }
 
 StaticFileServer::~StaticFileServer()
 {
+    stop();
     if (fd != 0) {
         close(fd);
     }
@@ -151,87 +188,508 @@ bool StaticFileServer::start()
         return false;
     }
 
-    int ifd = inotify_init();
-    logger::debug(fmt::format("inotify-init return {}", fd));
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    logger::debug(fmt::format("inotify-init return {}", ifd));
     if (ifd < 0) {
         logger::error(fmt::format(
             "inotify-init: inotify_init(2) {} failed:{}. StaticFileServer refused to start",
             path,
             strerror(errno)));
         return false;
-    } else {
-        status = inotify_add_watch(
-            ifd, path.c_str(), IN_MODIFY | IN_DELETE | IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO);
-        if (status == -1) {
-            logger::error(
-                fmt::format("inotify-init: inotify_add_watch(2) {} failed:{}. StaticFileServer "
-                            "refused to start",
-                            path,
-                            strerror(errno)));
-            close(ifd);
-            return false;
-        } else {
-            logger::info(fmt::format("inotify-init: inotify_add_watch(2) to {} success", path));
-            fd = ifd;
-            list_files();
-            start_thread();
-            return true;
-        }
     }
+    fd = ifd;
+    load_etags();
+    if (!watch_tree("")) {
+        logger::error(fmt::format(
+            "inotify-init: watching {} failed. StaticFileServer refused to start", path));
+        close(ifd);
+        fd = 0;
+        dirs.clear();
+        pending.clear();
+        knownHashes.clear();
+        return false;
+    }
+    logger::info(fmt::format("inotify-init: inotify_add_watch(2) to {} success", path));
+    flush();
+    start_thread();
+    return true;
 }
 
-void StaticFileServer::list_files()
+// watch `top' and the directories below it, their files go to `pending'. false if `top' itself
+// cannot be watched
+bool StaticFileServer::watch_tree(const std::string& top)
 {
-    std::stack<std::string> dirs;
-    const char ln[] = "StaticFile-startup";
-    dirs.push(path);
-    while (!dirs.empty()) {
-        auto dir = dirs.top();
-        dirs.pop();
-
-        DIR* dirp = opendir(dir.c_str());
+    const char ln[] = "StaticFile-watch";
+    std::stack<std::string> todo;
+    todo.push(top);
+    while (!todo.empty()) {
+        auto dir = todo.top();
+        todo.pop();
+
+        auto full = path + dir;
+        int wd = inotify_add_watch(fd, full.c_str(), watchMask);
+        if (wd < 0) {
+            logger::error(fmt::format(
+                "{}: inotify_add_watch(2) {} failed: {}", ln, full, strerror(errno)));
+            if (dir == top) {
+                return false;
+            }
+            continue;
+        }
+        // the same directory again, through a symbolic link
+        auto known = dirs.find(wd);
+        if (known != dirs.end() && known->second != dir) {
+            continue;
+        }
+        dirs[wd] = dir;
+
+        DIR* dirp = opendir(full.c_str());
         if (dirp == nullptr) {
             logger::error(
-                fmt::format("{}: open directory '{}' failed: {}", ln, dir, strerror(errno)));
-            return;
+                fmt::format("{}: open directory '{}' failed: {}", ln, full, strerror(errno)));
+            continue;
         }
-        std::string tname;
-        tname.reserve(dir.length() + 256 + 20);
         while (auto f = readdir(dirp)) {
-            tname.clear();
             auto fname = f->d_name;
             if ((fname[0] == '.' && fname[1] == '\0')
                 || (fname[0] == '.' && fname[1] == '.' && fname[2] == '\0')) {
                 continue;
             }
-            tname = dir + "/" + fname;
-            struct stat st;
-            int status = stat(tname.c_str(), &st);
-            if (status == 0) {
-                bool regular = ((st.st_mode & S_IFMT) == S_IFREG);
-                if (((st.st_mode & S_IFMT) == S_IFDIR)) {
-                    dirs.push(tname);
-                } else if (regular) {
-                    if (stat(tname.c_str(), &st) == 0) {
-                        tname = tname.substr(path.length() + 1);
-                        file f(tname);
-                        f.size = st.st_size;
-                        f.last_save_time = 0xffffffff & st.st_mtim.tv_sec;
-                        auto h = std::hash<std::string>{}(tname);
-                        auto p = std::make_pair(h, f);
-                        files.emplace(p);
-                        logger::debug(fmt::format("track file {}", tname));
-                    }
+            auto name = dir + fname;
+            auto type = f->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                struct stat st;
+                if (stat((path + name).c_str(), &st) != 0) {
+                    logger::error(
+                        fmt::format("stat of file {} failed: {}", name, strerror(errno)));
+                    continue;
                 }
-            } else {
-                logger::error(fmt::format("stat of file {} failed: {}", tname, strerror(errno)));
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_DIR) {
+                todo.push(name + '/');
+            } else if (type == DT_REG) {
+                pending.insert(std::move(name));
             }
         }
         closedir(dirp);
     }
+    return true;
 }
 
-void StaticFileServer::start_thread() {}
+// forget the files and watches below `dir', which ends with '/'
+void StaticFileServer::remove_tree(const std::string& dir)
+{
+    auto below = [&dir](const std::string& name) {
+        return name.compare(0, dir.length(), dir) == 0;
+    };
+    for (auto it = files.lower_bound(dir); it != files.end() && below(it->first);) {
+        touch(it->first);
+        it = files.erase(it);
+    }
+    for (auto it = dirs.begin(); it != dirs.end();) {
+        if (below(it->second)) {
+            // fails for a deleted directory, whose watch is gone already
+            inotify_rm_watch(fd, it->first);
+            it = dirs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void StaticFileServer::track(const std::string& name, const file& f)
+{
+    files.insert_or_assign(name, f);
+    touch(name);
+    logger::debug(fmt::format("track file {}", name));
+}
+
+void StaticFileServer::untrack(const std::string& name)
+{
+    if (files.erase(name) != 0) {
+        touch(name);
+        logger::debug(fmt::format("untrack file {}", name));
+    }
+}
+
+// `name' changed: so did its cached bodies, and the Vary header of the file it is a
+// precompressed sibling of
+void StaticFileServer::touch(const std::string& name)
+{
+    auto key = std::hash<std::string_view>{}(name);
+    changed.push_back(key);
+    changed.push_back(encodedKey(key));
+    for (const auto& e : encodings) {
+        std::string_view n(name);
+        auto base = n.length() - e.suffix.length();
+        if (n.length() > e.suffix.length() && n.substr(base) == e.suffix) {
+            changed.push_back(std::hash<std::string_view>{}(n.substr(0, base)));
+        }
+    }
+}
+
+// apply `pending' and publish the new index. Cached bodies are dropped only then, so that a
+// request filling the cache after the drop also sees the new index
+void StaticFileServer::flush()
+{
+    // files whose content must be hashed
+    std::vector<std::pair<std::string, file>> todo;
+    for (const auto& name : pending) {
+        struct stat st;
+        if (stat((path + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            untrack(name);
+            continue;
+        }
+        file f(types.type_of(name));
+        f.set_stat(st);
+        auto known = knownHashes.find(f.id);
+        if (known != knownHashes.end()) {
+            f.hash = known->second;
+            track(name, f);
+        } else {
+            todo.emplace_back(name, f);
+        }
+    }
+    pending.clear();
+    bool save = !etagIndex.empty() && (!todo.empty() || !knownHashes.empty());
+    knownHashes.clear();
+
+    // on as many threads as there are cores, with at least 16 files for each
+    std::vector<char> hashed(todo.size(), 0);
+    std::atomic<size_t> next{0};
+    auto work = [this, &todo, &hashed, &next]() {
+        std::vector<char> buf(128 << 10);
+        for (size_t i; (i = next.fetch_add(1)) < todo.size();) {
+            hashed[i] = todo[i].second.hash_content(path + todo[i].first, buf);
+        }
+    };
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                      (todo.size() + 15) / 16);
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; ++i) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& t : pool) {
+        t.join();
+    }
+    for (size_t i = 0; i < todo.size(); ++i) {
+        if (hashed[i]) {
+            track(todo[i].first, todo[i].second);
+        } else {
+            untrack(todo[i].first);
+        }
+    }
+    if (!todo.empty()) {
+        logger::debug(fmt::format("static: hashed {} files on {} threads", todo.size(), threads));
+    }
+
+    auto next_index = new Index(files.size());
+    for (const auto& f : files) {
+        next_index->add(f.first, f.second);
+    }
+    std::string sibling;
+    for (auto& f : *next_index) {
+        for (size_t i = 0; i < ENCODINGS; ++i) {
+            sibling.assign(f.path).append(encodings[i].suffix);
+            auto v = next_index->find(sibling);
+            f.variants[i] = v != nullptr ? next_index->position(*v) + 1 : 0;
+        }
+    }
+    index.publish(next_index);
+
+    cache.invalidate(changed);
+    changed.clear();
+
+    if (save) {
+        save_etags();
+    }
+}
+
+bool StaticFileServer::setEtagIndex(const std::string& name)
+{
+    // writing it must not look like a change of the served tree
+    auto slash = name.find_last_of('/');
+    auto dir = slash == std::string::npos ? std::string(".") : name.substr(0, slash + 1);
+    char* realDir = realpath(dir.c_str(), nullptr);
+    char* realRoot = realpath(path.c_str(), nullptr);
+    bool inside = realDir != nullptr && realRoot != nullptr
+                  && (std::string(realDir) + '/').compare(0, strlen(realRoot) + 1,
+                                                          std::string(realRoot) + '/')
+                         == 0;
+    free(realDir);
+    free(realRoot);
+    if (inside) {
+        logger::error(fmt::format(
+            "static: ETag index {} is inside the served directory {}, ignored", name, path));
+        return false;
+    }
+    etagIndex = name;
+    return true;
+}
+
+// one line per file: inode size mtime hash. A missing or damaged index only costs hashing
+void StaticFileServer::load_etags()
+{
+    if (etagIndex.empty()) {
+        return;
+    }
+    FILE* in = fopen(etagIndex.c_str(), "re");
+    if (in == nullptr) {
+        if (errno != ENOENT) {
+            logger::error(
+                fmt::format("static: open ETag index {}: {}", etagIndex, strerror(errno)));
+        }
+        return;
+    }
+    int version = 0;
+    if (fscanf(in, "whs-etags %d\n", &version) == 1 && version == 1) {
+        stamp id;
+        uint64_t hash;
+        while (fscanf(in,
+                      "%" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNx64 "\n",
+                      &id.inode,
+                      &id.size,
+                      &id.mtime,
+                      &hash)
+               == 4) {
+            knownHashes.emplace(id, hash);
+        }
+    }
+    fclose(in);
+    logger::debug(fmt::format("static: {} ETags from {}", knownHashes.size(), etagIndex));
+}
+
+void StaticFileServer::save_etags() const
+{
+    auto tmp = etagIndex + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "we");
+    if (out == nullptr) {
+        logger::error(fmt::format("static: create ETag index {}: {}", tmp, strerror(errno)));
+        return;
+    }
+    bool ok = fprintf(out, "whs-etags 1\n") > 0;
+    for (auto f = files.begin(); ok && f != files.end(); ++f) {
+        const auto& id = f->second.id;
+        ok = fprintf(out,
+                     "%" PRIu64 " %" PRIu64 " %" PRId64 " %" PRIx64 "\n",
+                     id.inode,
+                     id.size,
+                     id.mtime,
+                     f->second.hash)
+             > 0;
+    }
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), etagIndex.c_str()) != 0) {
+        logger::error(fmt::format("static: write ETag index {}: {}", etagIndex, strerror(errno)));
+        unlink(tmp.c_str());
+    }
+}
+
+void StaticFileServer::start_thread()
+{
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (stopFd < 0) {
+        logger::error(fmt::format(
+            "inotify: eventfd(2) failed: {}. Changes of {} are ignored", strerror(errno), path));
+        return;
+    }
+    watcher = std::thread(&StaticFileServer::watch, this);
+}
+
+void StaticFileServer::stop()
+{
+    if (watcher.joinable()) {
+        uint64_t one = 1;
+        if (::write(stopFd, &one, sizeof(one)) == sizeof(one)) {
+            watcher.join();
+        } else {
+            watcher.detach();
+        }
+    }
+    if (stopFd >= 0) {
+        close(stopFd);
+        stopFd = -1;
+    }
+}
+
+void StaticFileServer::watch()
+{
+    // a deploy changes many files at once: events are gathered until the tree is quiet for
+    // `settle' ms, but no longer than `maxDelay' ms, then applied as one new index
+    constexpr int settle = 20;
+    constexpr auto maxDelay = std::chrono::milliseconds(200);
+    std::chrono::steady_clock::time_point due;
+
+    alignas(inotify_event) char buf[4096];
+    pollfd fds[2] = {{fd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+    while (true) {
+        bool idle = pending.empty() && changed.empty();
+        auto ready = poll(fds, 2, idle ? -1 : settle);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger::error(fmt::format("inotify: poll(2) failed: {}", strerror(errno)));
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return;
+        }
+
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            for (char* p = buf; p < buf + n;) {
+                auto event = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    logger::error(fmt::format("inotify: events lost, rescanning {}", path));
+                    for (const auto& f : files) {
+                        pending.insert(f.first);
+                    }
+                    dirs.clear();
+                    watch_tree("");
+                    continue;
+                }
+                auto dir = dirs.find(event->wd);
+                if (dir == dirs.end()) {
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    dirs.erase(dir);
+                    continue;
+                }
+                if (event->len == 0) {
+                    continue;
+                }
+                auto name = dir->second + event->name;
+                logger::debug(fmt::format("inotify: {} changed (mask {:#x})", name, event->mask));
+                if (!(event->mask & IN_ISDIR)) {
+                    pending.insert(std::move(name));
+                } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    watch_tree(name + '/');
+                } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    remove_tree(name + '/');
+                }
+            }
+        }
+
+        if (pending.empty() && changed.empty()) {
+            continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (idle) {
+            due = now + maxDelay;
+        }
+        if (ready == 0 || now >= due) {
+            flush();
+        }
+    }
+}
+
+// what answering a GET or HEAD of a found file takes, copied out of the request and the index
+struct StaticFileServer::reply {
+    std::string_view mime;  // builtin, or in `types'
+    char etag[ETAG_LENGTH + 1];
+    std::string lastModified;
+    uint64_t key;  // of the body in the cache
+    int coding;    // of the precompressed sibling sent, -1 for the file itself
+    bool varies;   // the file has precompressed siblings
+    bool cacheable;
+    bool notModified;
+    bool ranged;
+    std::string range;
+};
+
+/**
+ * @brief Read: opens the file, and reads it into the cache if it is small, off the event loop.
+ *
+ * A cold read (network storage, a page cache under pressure) would stall every connection of
+ * the loop otherwise.
+ */
+class StaticFileServer::Read : public Deferred
+{
+    const StaticFileServer* server;
+    reply r;
+    std::string name;
+    utils::FileCache::Entry* e;
+    int rd;
+    size_t size;
+    int error;
+
+public:
+    Read(const StaticFileServer* s, reply&& r, std::string&& name)
+        : server(s), r(std::move(r)), name(std::move(name)), e(nullptr), rd(-1), size(0), error(0)
+    {
+    }
+
+    virtual ~Read()
+    {
+        if (e != nullptr) {
+            utils::FileCache::release(e);
+        }
+        if (rd != -1) {
+            close(rd);
+        }
+    }
+
+    virtual void run() override
+    {
+        auto& cache = server->cache;
+        auto epoch = cache.currentEpoch();
+        rd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat sb;
+        if (rd < 0 || fstat(rd, &sb) != 0) {
+            error = errno;
+            return;
+        }
+        // the file may have changed since it was indexed
+        size = sb.st_size;
+        if (r.cacheable && cache.cacheable(size)) {
+            e = cache.put(r.key, server->cachedHead(r), rd, size, epoch);
+            close(rd);
+            rd = -1;
+            if (e == nullptr) {
+                error = EIO;
+            }
+        }
+    }
+
+    virtual void complete(Response& resp) override
+    {
+        if (error != 0) {
+            logger::error(fmt::format("static: open '{}' failed: {}", name, strerror(error)));
+            resp[utils::CommonHeader::CacheControl] = "no-store";
+            resp.status(error == ENOENT ? HTTP_STATUS_NOT_FOUND
+                                        : HTTP_STATUS_INTERNAL_SERVER_ERROR);
+            return;
+        }
+        server->respond(r, resp, e, rd, size);
+        e = nullptr;
+        rd = -1;
+    }
+};
+
+std::string StaticFileServer::cachedHead(const reply& r) const
+{
+    auto head = fmt::format("{}: {}\r\n{}: {}\r\n{}: {}\r\nAccept-Ranges: bytes\r\n",
+                            utils::mapCommonHeader(utils::CommonHeader::ContentType),
+                            r.mime,
+                            utils::mapCommonHeader(utils::CommonHeader::Etag),
+                            r.etag,
+                            utils::mapCommonHeader(utils::CommonHeader::LastModified),
+                            r.lastModified);
+    if (r.coding >= 0) {
+        head += fmt::format("{}: {}\r\n",
+                            utils::mapCommonHeader(utils::CommonHeader::ContentEncoding),
+                            encodings[r.coding].token);
+    }
+    if (r.varies) {
+        head += "Vary: Accept-Encoding\r\n";
+    }
+    return head;
+}
 
 bool StaticFileServer::operator()(Request& req, Response& resp) const THROWS
 {
@@ -242,82 +700,267 @@ bool StaticFileServer::operator()(Request& req, Response& resp) const THROWS
     }
 
     auto url = req.getBaseURL();
-    if (prefix != "") {
-        url = url.substr(prefix.length());
-    }
-    auto hash = std::hash<std::string>{}(url);
-    const auto& f = files.find(hash);
-    if (f == files.end()) {
+    if (url.compare(0, prefix.length(), prefix) != 0) {
         return true;
-    } else {
-        std::string tf;
-        time_t st = f->second.get_save_time();
-        auto t = gmtime(&st);
-        utils::format_time(t, tf);
-        resp.addHeader(utils::CommonHeader::ContentType, f->second.mime);
-        resp.addHeader(utils::CommonHeader::Etag, f->second.etag);
-        resp.addHeader(utils::CommonHeader::LastModified, tf);
-        if (mth == HTTP_GET) {
-            if (req.getHeader("if-none-match", tf)) {
-                if (0
-                    == std::char_traits<char>::compare(
-                        tf.c_str(),
-                        f->second.etag,
-                        std::min(tf.length(), static_cast<size_t>(ETAG_LENGTH)))) {
-                    resp.status(HTTP_STATUS_NOT_MODIFIED);
-                    resp.addHeaderIfNotExists(utils::CommonHeader::CacheControl, cc);
-                    return false;
-                }
+    }
+    url.remove_prefix(prefix.length());
+    std::string_view accept;
+    bool negotiate = req.getHeader(std::string_view("accept-encoding"), accept);
+
+    // copies: the watcher may replace the index as soon as the reader is gone, their paths go
+    // with it. `body' is what is sent: the file, or the precompressed sibling of `r.coding'
+    std::optional<indexed> body;
+    reply r;
+    r.coding = -1;
+    {
+        auto files = index.read();
+        auto f = files->find(url);
+        if (f == nullptr) {
+            return true;
+        }
+        r.mime = f->mime;
+        std::string_view tokens[ENCODINGS];
+        size_t which[ENCODINGS], count = 0;
+        for (size_t i = 0; i < ENCODINGS; ++i) {
+            if (f->variants[i] != 0) {
+                tokens[count] = encodings[i].token;
+                which[count++] = i;
             }
-            char* buf = new char[f->second.size];
-            std::string fname = path + '/' + url;
-            int rd = open(fname.c_str(), O_RDONLY);
-            if (rd > 0) {
-                auto nread = read(rd, buf, f->second.size);
-                if (nread == f->second.size) {
-                    resp.setBody(buf, f->second.size);
-                    resp.addHeaderIfNotExists(utils::CommonHeader::CacheControl, cc);
-                }
-                close(rd);
+        }
+        r.varies = count != 0;
+        auto chosen = negotiate ? utils::negotiateEncoding(accept, tokens, count) : -1;
+        if (chosen >= 0) {
+            r.coding = which[chosen];
+            body = *files->variant(*f, r.coding);
+        } else {
+            body = *f;
+        }
+    }
+    r.key = r.coding >= 0 ? encodedKey(body->key) : body->key;
+    // the cache only knows keys
+    r.cacheable = !body->shared;
+    body->etag(r.etag);
+    time_t st = body->get_save_time();
+    struct tm t;
+    gmtime_r(&st, &t);
+    utils::format_time(&t, r.lastModified);
+
+    std::string_view inm;
+    r.notModified = mth == HTTP_GET && req.getHeader(std::string_view("if-none-match"), inm)
+                    && utils::noneMatchHits(inm, std::string_view(r.etag, ETAG_LENGTH));
+    std::string_view range, ifRange;
+    r.ranged = mth == HTTP_GET && !r.notModified
+               && req.getHeader(std::string_view("range"), range);
+    // a partial response only if the client's part is of this very file: strong comparison,
+    // a weak tag never matches
+    if (r.ranged && req.getHeader(std::string_view("if-range"), ifRange)
+        && ifRange != std::string_view(r.etag, ETAG_LENGTH) && ifRange != r.lastModified) {
+        r.ranged = false;
+    }
+    if (r.ranged) {
+        r.range = range;
+    }
+    resp.addHeaderIfNotExists(utils::CommonHeader::CacheControl, cc);
+
+    utils::FileCache::Entry* e = nullptr;
+    if (mth == HTTP_GET && !r.notModified) {
+        if (r.cacheable) {
+            e = cache.get(r.key);
+        }
+        if (e == nullptr) {
+            std::string name = path;  // ends with '/'
+            name.append(url);
+            if (r.coding >= 0) {
+                name.append(encodings[r.coding].suffix);
             }
+            // provisional: the pipelines see a response, Read sets the final status
+            resp.status(HTTP_STATUS_OK);
+            resp.defer(new Read(this, std::move(r), std::move(name)));
+            return false;
         }
-        resp.addHeader(utils::CommonHeader::ContentLength, std::to_string(f->second.size));
     }
+    respond(r, resp, e, -1, e != nullptr ? e->body.size() : body->size);
     return false;
 }
 
-StaticFileServer::file::file(const std::string& fname) : mime(default_mime)
+void StaticFileServer::respond(
+    const reply& r, Response& resp, utils::FileCache::Entry* e, int rd, size_t size) const
+{
+    std::vector<utils::ByteRange> ranges;
+    auto parsed = r.ranged ? utils::parseRanges(r.range, size, ranges) : utils::RangeResult::Ignore;
+    if (parsed == utils::RangeResult::Ignore && e != nullptr) {
+        sendCached(resp, e);
+        resp.status(HTTP_STATUS_OK);
+        return;
+    }
+
+    resp.addHeader(utils::CommonHeader::Etag, r.etag);
+    resp.addHeader(utils::CommonHeader::LastModified, r.lastModified);
+    resp.addHeader("Accept-Ranges", "bytes");
+    if (r.coding >= 0) {
+        resp.addHeader(utils::CommonHeader::ContentEncoding, encodings[r.coding].token);
+    }
+    if (r.varies) {
+        resp.addHeader("Vary", "Accept-Encoding");
+    }
+    if (parsed == utils::RangeResult::Satisfiable) {
+        // the tag without its quotes
+        std::string_view boundary(r.etag + 1, ETAG_LENGTH - 2);
+        sendRanges(resp, ranges, size, r.mime, boundary, e, rd);
+        if (e != nullptr) {
+            utils::FileCache::release(e);
+        }
+        return;
+    }
+    if (parsed == utils::RangeResult::Unsatisfiable) {
+        if (e != nullptr) {
+            utils::FileCache::release(e);
+        }
+        if (rd != -1) {
+            close(rd);
+        }
+        resp.addHeader("Content-Range", fmt::format("bytes */{}", size));
+        resp.status(HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+        return;
+    }
+
+    resp.addHeader(utils::CommonHeader::ContentType, r.mime);
+    if (r.notModified) {
+        resp.status(HTTP_STATUS_NOT_MODIFIED);
+        return;
+    }
+    if (rd != -1) {
+        // the body is a reference to the file: the backend sends it with sendfile(2), so it is
+        // neither read into user space nor on the event loop thread
+        BodyChunk chunk = {nullptr, size, closeFile, nullptr};
+        chunk.fd = rd;
+        resp.appendBody(chunk);
+    }
+    resp.addHeader(utils::CommonHeader::ContentLength, std::to_string(size));
+    resp.status(HTTP_STATUS_OK);
+}
+
+StaticFileServer::file::file(std::string_view mime) : mime(mime)
 {
     last_save_time = size = 0;
-    for (uint8_t i = 0; i < ETAG_LENGTH + 1; i++) {
-        etag[i] = 0;
-    };
-    auto dot = fname.find_last_of('.');
-    if (dot != std::string::npos && dot != fname.length() - 1) {
-        std::string tmp(fname, dot + 1);
+    id = {0, 0, 0};
+    hash = 0;
+}
+
+void StaticFileServer::file::set_stat(const struct stat& st)
+{
+    size = st.st_size;
+    last_save_time = 0xffffffff & st.st_mtim.tv_sec;
+    id.inode = st.st_ino;
+    id.size = st.st_size;
+    id.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+bool StaticFileServer::file::hash_content(const std::string& name, std::vector<char>& buf)
+{
+    int rd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (rd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(rd, &st) == 0;
+    if (ok) {
+        set_stat(st);
+    }
+    utils::Xxh64 h;
+    while (ok) {
+        auto n = read(rd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        h.update(buf.data(), n);
+    }
+    if (!ok) {
+        logger::error(fmt::format("static: read of {} failed: {}", name, strerror(errno)));
+    }
+    close(rd);
+    if (ok) {
+        hash = h.digest();
+    }
+    return ok;
+}
 
-        mime = search_mime(tmp.c_str());
+void StaticFileServer::indexed::etag(char (&out)[ETAG_LENGTH + 1]) const
+{
+    snprintf(out, sizeof(out), "\"%016" PRIx64 "\"", hash);
+}
+
+StaticFileServer::Index::Index(size_t count)
+{
+    entries.reserve(count);
+    size_t size = 16;
+    while (size < count * 2) {
+        size <<= 1;
     }
-    calc_etag(fname);
+    slots.assign(size, {0, 0});
 }
 
-void StaticFileServer::file::calc_etag(const std::string& fname)
+StaticFileServer::indexed& StaticFileServer::Index::add(std::string_view name, const file& f)
 {
-    MD5_CTX ctx;
-    MD5_Init(&ctx);
-    unsigned char md5[MD5_DIGEST_LENGTH] = {0};
-    std::string misc = fmt::format(
-        "{}-{}-{}-{}", next_rand(), next_rand(), next_rand(), reinterpret_cast<void*>(this));
-    misc.append(fname);
-
-    MD5_Update(&ctx, misc.c_str(), misc.length());
-    MD5_Final(md5, &ctx);
-    std::string out;
-
-    char buf[4] = {0};
-    for (int i = 0; i < 16; i++) {
-        snprintf(buf, 4, "%02x", md5[i]);
-        out.append(buf);
-    }
-    memcpy(etag, out.c_str(), ETAG_LENGTH);
-}
\ No newline at end of file
+    if ((entries.size() + 1) * 2 > slots.size()) {
+        std::vector<slot> old(slots.size() * 2, {0, 0});
+        old.swap(slots);
+        for (const auto& o : old) {
+            if (o.entry == 0) {
+                continue;
+            }
+            auto mask = slots.size() - 1;
+            auto i = entries[o.entry - 1].key & mask;
+            for (; slots[i].entry != 0; i = (i + 1) & mask) {
+            }
+            slots[i] = o;
+        }
+    }
+
+    auto key = std::hash<std::string_view>{}(name);
+    auto tag = static_cast<uint32_t>(key >> 32);
+    bool shared = false;
+    auto mask = slots.size() - 1;
+    auto i = key & mask;
+    for (; slots[i].entry != 0; i = (i + 1) & mask) {
+        auto& other = entries[slots[i].entry - 1];
+        if (slots[i].tag == tag && other.key == key) {
+            other.shared = shared = true;
+        }
+    }
+    slots[i] = {tag, static_cast<uint32_t>(entries.size() + 1)};
+
+    indexed e;
+    e.path = paths.copy(name);
+    e.mime = f.mime;
+    e.key = key;
+    e.hash = f.hash;
+    e.size = f.size;
+    e.last_save_time = f.last_save_time;
+    for (auto& v : e.variants) {
+        v = 0;
+    }
+    e.shared = shared;
+    entries.push_back(e);
+    return entries.back();
+}
+
+const StaticFileServer::indexed* StaticFileServer::Index::find(std::string_view name,
+                                                                uint64_t key) const
+{
+    auto tag = static_cast<uint32_t>(key >> 32);
+    auto mask = slots.size() - 1;
+    for (auto i = key & mask; slots[i].entry != 0; i = (i + 1) & mask) {
+        if (slots[i].tag == tag) {
+            const auto& e = entries[slots[i].entry - 1];
+            if (e.path == name) {
+                return &e;
+            }
+        }
+    }
+    return nullptr;
+}
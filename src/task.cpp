@@ -0,0 +1,108 @@
+#include "whs/task.h"
+#include "whs-internal.h"
+#include "fmt/format.h"
+
+using namespace whs;
+
+void *utils::frame::allocate(size_t size, Request *req)
+{
+    char *p;
+    if (req != nullptr) {
+        p = static_cast<char *>(req->allocate(header + size, header));
+    } else {
+        p = static_cast<char *>(::operator new(header + size));
+    }
+    // released with the request, or by release()
+    *reinterpret_cast<bool *>(p) = req == nullptr;
+    return p + header;
+}
+
+void utils::frame::release(void *frame)
+{
+    auto p = static_cast<char *>(frame) - header;
+    if (*reinterpret_cast<bool *>(p)) {
+        ::operator delete(p);
+    }
+}
+
+void utils::complete(root *r, std::exception_ptr error) noexcept
+{
+    if (error) {
+        auto &resp = *r->resp;
+        try {
+            std::rethrow_exception(error);
+        } catch (const HttpException &he) {
+            char *buf;
+            size_t size;
+            he.buildResponse(buf, size);
+            resp.setBody(buf, size);
+            resp.status(he.getStatusCode());
+        } catch (...) {
+            logger::error("whs: a coroutine handler failed");
+            static const char fatal[] = "System fatal error.";
+            resp.setBody(utils::dup_memory(fatal, sizeof(fatal) - 1), sizeof(fatal) - 1);
+            resp.status(HTTP_STATUS_INTERNAL_SERVER_ERROR);
+            resp.addHeader(utils::CommonHeader::ContentType, "text/plain");
+        }
+    }
+    r->resume();
+}
+
+bool AsyncMiddleware::operator()(Request &req, Response &resp) const THROWS
+{
+    // views the coroutine takes before its first suspension must survive it
+    req.pin();
+    auto t = handle(req, resp);
+    auto h = t._h;
+    h.resume();
+    if (h.done()) {
+        if (auto error = h.promise().error) {
+            std::rethrow_exception(error);
+        }
+        return true;
+    }
+    // the frame destroys itself once done, then the pipelines go on
+    auto r = new (req.allocate(sizeof(utils::root), alignof(utils::root)))
+        utils::root{req.suspend(), &resp};
+    h.promise().detached = r;
+    t._h = nullptr;
+    return true;
+}
+
+#ifdef ENABLE_LIBUV
+void delay::await_suspend(std::coroutine_handle<> h)
+{
+    _waiting = h;
+    auto r = LibuvWhs::current();
+    assert(r != nullptr);
+    uv_timer_init(LibuvWhs::loop(r), &_timer);
+    _timer.data = this;
+    uv_timer_start(
+        &_timer,
+        [](uv_timer_t *t) {
+            // the handle is in the frame: resume once libuv is done with it
+            uv_close(reinterpret_cast<uv_handle_t *>(t), [](uv_handle_t *h) {
+                static_cast<delay *>(h->data)->_waiting.resume();
+            });
+        },
+        _ms,
+        0);
+}
+
+uv_loop_t *fs::begin()
+{
+    if (_used) {
+        uv_fs_req_cleanup(&_req);
+    }
+    _used = true;
+    _req.data = this;
+    auto r = LibuvWhs::current();
+    assert(r != nullptr);
+    return LibuvWhs::loop(r);
+}
+
+void fs::done(uv_fs_t *req)
+{
+    static_cast<fs *>(req->data)->_waiting.resume();
+}
+#endif
@@ -3,6 +3,7 @@
 #include "whs-internal.h"
 #include "whs/builder.h"
 #include "whs/entity.h"
+#include "whs/pipeline.h"
 
 using namespace whs;
 
@@ -22,6 +23,17 @@ namespace
             return true;
         }
     };
+
+    template <int N>
+    class Digit : public Middleware
+    {
+    public:
+        virtual bool operator()(Request&, Response& resp) const THROWS override
+        {
+            resp.status(resp.status() * 10 + N);
+            return true;
+        }
+    };
 }  // namespace
 
 TEST(builder_test, pipelinebuilder)
@@ -43,10 +55,36 @@ TEST(builder_test, pipelinebuilder)
     ASSERT_EQ(resp.status(), 10);  // 0 + 1 + 2 + 3 + 4
 }
 
+TEST(builder_test, staticPipeline)
+{
+    PipelineBuilder b(new StaticPipeline<Digit<1>, Digit<2>, Digit<3>>);
+    b.addMiddleware<Digit<4>>();
+
+    Pipeline p(b);
+
+    Request req;
+    Response resp;
+    resp.status(0);
+    p.feed(req, resp);
+    ASSERT_EQ(resp.status(), 1234);
+
+    // going on from a stage, as after a suspension
+    for (auto [from, status] : {std::pair(0, 1234), std::pair(2, 34), std::pair(3, 4)}) {
+        size_t next = from;
+        resp.status(0);
+        ASSERT_TRUE(p.feed(req, resp, next));
+        EXPECT_EQ(next, 4u);
+        EXPECT_EQ(resp.status(), status);
+    }
+}
+
 TEST(entity, request_process_data)
 {
     Request req;
     req.put_processing_data("apple", &req);
     ASSERT_EQ(req.get_processing_data("apple"), &req);
+    // not replaced
+    req.put_processing_data("apple", nullptr);
+    ASSERT_EQ(req.get_processing_data("apple"), &req);
     ASSERT_EQ(req.get_processing_data("orange"), nullptr);
 }
\ No newline at end of file
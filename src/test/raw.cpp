@@ -3,6 +3,7 @@
 #include "whs/builder.h"
 #include "whs/entity.h"
 #include "whs/whs.h"
+#include "whs/task.h"
 
 #include "whs-internal.h"
 
@@ -29,6 +30,73 @@ namespace
             return true;
         }
     };
+
+    // suspends requests to /slow, the test finishes them
+    struct Suspended {
+        Request *req;
+        Response *resp;
+        Resume resume;
+    } suspended;
+
+    class SlowMiddleware : public Middleware
+    {
+        virtual bool operator()(Request &req, Response &res) const THROWS override
+        {
+            if (req.getBaseURL() == "/slow") {
+                suspended = {&req, &res, req.suspend()};
+            }
+            return true;
+        }
+    };
+
+    // resumed by the test, as a timer or another thread would
+    struct Gate {
+        std::coroutine_handle<> waiting;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            waiting = h;
+        }
+
+        void await_resume() const noexcept {}
+    } gate;
+
+    task<size_t> nameLength(Request &req)
+    {
+        co_await gate;
+        std::string_view name;
+        req.getHeader("x-name", name);
+        co_return name.size();
+    }
+
+    class CoroutineHandler : public AsyncMiddleware
+    {
+        virtual task<> handle(Request &req, Response &res) const override
+        {
+            auto length = co_await nameLength(req);
+            auto body = std::to_string(length);
+            res.setBody(utils::dup_memory(body.data(), body.size()), body.size());
+            res.status(HTTP_STATUS_OK);
+        }
+    };
+
+    // takes a view of its param, then waits
+    class ParamHandler : public AsyncMiddleware
+    {
+        virtual task<> handle(Request &req, Response &res) const override
+        {
+            std::string_view name;
+            req.getParam(std::string_view("name"), name);
+            co_await gate;
+            res.setBody(utils::dup_memory(name.data(), name.size()), name.size());
+            res.status(HTTP_STATUS_OK);
+        }
+    };
 }  // namespace
 
 TEST(whs, RawWhs)
@@ -56,4 +124,102 @@ TEST(whs, RawWhs)
     auto sub = out.substr(pos + 1);
     ASSERT_NE(sub.length(), 0u);
     ASSERT_EQ(sub, spStr);
-}
\ No newline at end of file
+}
+
+TEST(whs, RawWhsSuspend)
+{
+    RawWhs r;
+    PipelineBuilder a, b;
+    route::HttpRouteBuilder rb;
+
+    a.addMiddleware<SlowMiddleware>();
+    rb.use<SomePathHandler>(HTTP_GET, "/some-path");
+    r.setup(&a, &rb, &b);
+    r.init();
+    r.setup();
+    r.start();
+
+    std::string in = "GET /slow HTTP/1.1\r\nX-Name: first\r\n\r\n";
+    in += req_1;
+    r.in(in.data(), in.size());
+    // the suspended request holds back the one after it
+    ASSERT_EQ(r.readable_size(), 0u);
+    ASSERT_TRUE(suspended.req->isSuspended());
+
+    // the request no longer points into the read buffer
+    in.assign(in.size(), 'x');
+    std::string_view name;
+    ASSERT_TRUE(suspended.req->getHeader("x-name", name));
+    ASSERT_EQ(name, "first");
+    suspended.resp->setBody(utils::dup_memory(name.data(), name.size()), name.size());
+    suspended.resp->status(HTTP_STATUS_OK);
+    suspended.resume();
+
+    char buf[1024];
+    size_t s = sizeof(buf);
+    r.out(buf, s);
+    std::string out(buf, s);
+    auto first = out.find("\r\n\r\nfirst");
+    auto second = out.find(spStr);
+    ASSERT_NE(first, std::string::npos) << out;
+    ASSERT_NE(second, std::string::npos) << out;
+    ASSERT_LT(first, second);
+}
+
+TEST(whs, RawWhsCoroutine)
+{
+    RawWhs r;
+    PipelineBuilder a, b;
+    route::HttpRouteBuilder rb;
+
+    rb.use<CoroutineHandler>(HTTP_GET, "/coroutine");
+    rb.use<SomePathHandler>(HTTP_GET, "/some-path");
+    r.setup(&a, &rb, &b);
+    r.init();
+    r.setup();
+    r.start();
+
+    std::string in = "GET /coroutine HTTP/1.1\r\nX-Name: first\r\n\r\n";
+    in += req_1;
+    r.in(in.data(), in.size());
+    ASSERT_EQ(r.readable_size(), 0u);
+    ASSERT_TRUE(gate.waiting);
+
+    gate.waiting.resume();
+    char buf[1024];
+    size_t s = sizeof(buf);
+    r.out(buf, s);
+    std::string out(buf, s);
+    auto first = out.find("\r\n\r\n5");
+    auto second = out.find(spStr);
+    ASSERT_NE(first, std::string::npos) << out;
+    ASSERT_NE(second, std::string::npos) << out;
+    ASSERT_LT(first, second);
+}
+
+TEST(whs, RawWhsCoroutineViews)
+{
+    RawWhs r;
+    PipelineBuilder a, b;
+    route::HttpRouteBuilder rb;
+
+    rb.use<ParamHandler>(HTTP_GET, "/hello/{name}");
+    r.setup(&a, &rb, &b);
+    r.init();
+    r.setup();
+    r.start();
+
+    std::string in = "GET /hello/world HTTP/1.1\r\n\r\n";
+    r.in(in.data(), in.size());
+    ASSERT_EQ(r.readable_size(), 0u);
+    ASSERT_TRUE(gate.waiting);
+
+    // the read buffer is reused meanwhile: the view taken before co_await does not point there
+    in.assign(in.size(), 'x');
+    gate.waiting.resume();
+    char buf[1024];
+    size_t s = sizeof(buf);
+    r.out(buf, s);
+    std::string out(buf, s);
+    ASSERT_NE(out.find("\r\n\r\nworld"), std::string::npos) << out;
+}
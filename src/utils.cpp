@@ -4,125 +4,280 @@
 
 #include "fmt/format.h"
 
+#include <algorithm>
+#include <charconv>
+
 using std::string;
 using namespace whs;
 using whsutils::MemoryBuffer;
+using whsutils::BufferPool;
+using whsutils::DateCache;
 
-void MemoryBuffer::clear()
+void MemoryBuffer::reserve(size_t size)
 {
-    _pool.clear();
-    _gcount = _stored = 0;
+    if (_capacity - _end >= size) {
+        return;
+    }
+    auto stored = this->stored();
+    if (_capacity - stored >= size) {
+        // what was read makes room
+        memmove(_ptr, _ptr + _begin, stored);
+    } else {
+        auto capacity = std::max({_capacity * 2, stored + size, _minCapacity});
+        auto ptr = new char[capacity];
+        if (stored > 0) {
+            memcpy(ptr, _ptr + _begin, stored);
+        }
+        delete[] _ptr;
+        _ptr = ptr;
+        _capacity = capacity;
+    }
+    _begin = 0;
+    _end = stored;
 }
 
 size_t MemoryBuffer::write(const char *at, size_t size)
 {
-    auto remainSize = size;
-    auto ptr = at;
-    size_t wroteSize = 0;
-    if (_pool.size() == 0) {
-        do {
-            _Storage s;
-            wroteSize = s.write(ptr, remainSize);
-            ptr += wroteSize;
-            remainSize -= wroteSize;
-            _pool.emplace_back(std::move(s));
-            _stored += wroteSize;
-        } while (remainSize > 0);
-    } else {
-        auto &tail = _pool.back();
-        wroteSize = tail.write(ptr, remainSize);
-        ptr += wroteSize;
-        remainSize -= wroteSize;
-        _stored += wroteSize;
-        while (remainSize > 0) {
-            _Storage s;
-            wroteSize = s.write(ptr, remainSize);
-            ptr += wroteSize;
-            remainSize -= wroteSize;
-            _pool.emplace_back(std::move(s));
-            _stored += wroteSize;
-        }
+    if (size == 0) {
+        return 0;
     }
+    reserve(size);
+    memcpy(_ptr + _end, at, size);
+    _end += size;
+    return size;
+}
 
-#ifndef NDEBUG
-    auto testfunc = [this]() -> bool {
-        size_t store = 0;
-        for (auto &_entry : _pool) {
-            store += _entry.storedSize();
-        }
-        return store == _stored;
-    };
+bool MemoryBuffer::shrink(size_t limit)
+{
+    if (_capacity <= limit) {
+        return false;
+    }
+    auto stored = this->stored();
+    char *ptr = nullptr;
+    if (stored > 0) {
+        ptr = new char[stored];
+        memcpy(ptr, _ptr + _begin, stored);
+    }
+    delete[] _ptr;
+    _ptr = ptr;
+    _capacity = stored;
+    _begin = 0;
+    _end = stored;
+    return true;
+}
+
+size_t MemoryBuffer::read(char *dest, size_t &size)
+{
+    _gcount = std::min(size, stored());
+    if (_gcount == 0) {
+        return 0;
+    }
+    memcpy(dest, _ptr + _begin, _gcount);
+    _begin += _gcount;
+    if (_begin == _end) {
+        _begin = _end = 0;
+    }
+    return _gcount;
+}
 
-    assert(testfunc());
-#endif
+// arena
 
-    return wroteSize;
+utils::arena::~arena()
+{
+    while (_head) {
+        auto next = _head->next;
+        delete[] reinterpret_cast<char *>(_head);
+        _head = next;
+    }
 }
 
-size_t MemoryBuffer::read(char *dest, size_t &size)
+char *utils::arena::grow(size_t size)
 {
-#ifndef NDEBUG
-    auto testfunc = [this]() -> bool {
-        size_t store = 0;
-        for (auto &_entry : _pool) {
-            store += _entry.storedSize();
-        }
-        return store == _stored;
-    };
-
-    assert(testfunc());
-#endif
-
-    _gcount = 0;
-    size_t readSize = 0;
-    auto ptr = dest;
-    auto remain = size;
-    for (auto begin = _pool.begin(); begin != _pool.end(); begin++) {
-        readSize = begin->read(ptr, remain);
-        remain -= readSize;
-        ptr += readSize;
-        _gcount += readSize;
-        _stored -= readSize;
-        if (remain == 0) {
-            break;
+    size_t bsize = std::max(_minBlockSize, size);
+    if (_head && _head->size * 2 > bsize) {
+        bsize = _head->size * 2;
+    }
+    auto block = reinterpret_cast<_Block *>(new char[sizeof(_Block) + bsize]);
+    block->next = _head;
+    block->size = bsize;
+    _head = block;
+    _cur = reinterpret_cast<char *>(block + 1);
+    _end = _cur + bsize;
+    auto ret = _cur;
+    _cur += size;
+    return ret;
+}
+
+std::string_view utils::arena::copy(std::string_view v)
+{
+    if (v.empty()) {
+        return std::string_view();
+    }
+    auto p = allocate(v.size());
+    memcpy(p, v.data(), v.size());
+    return std::string_view(p, v.size());
+}
+
+std::string_view utils::arena::append(std::string_view head, std::string_view tail)
+{
+    if (head.data() + head.size() == _cur && static_cast<size_t>(_end - _cur) >= tail.size()) {
+        memcpy(_cur, tail.data(), tail.size());
+        _cur += tail.size();
+        return std::string_view(head.data(), head.size() + tail.size());
+    }
+    auto p = allocate(head.size() + tail.size());
+    memcpy(p, head.data(), head.size());
+    memcpy(p + head.size(), tail.data(), tail.size());
+    return std::string_view(p, head.size() + tail.size());
+}
+
+void utils::arena::reset()
+{
+    if (_head == nullptr) {
+        return;
+    }
+    // keep only the largest block, which is the newest one
+    auto keep = _head;
+    for (auto b = keep->next; b;) {
+        auto next = b->next;
+        delete[] reinterpret_cast<char *>(b);
+        b = next;
+    }
+    keep->next = nullptr;
+    _cur = reinterpret_cast<char *>(keep + 1);
+    _end = _cur + keep->size;
+}
+
+bool utils::arena::shrink(size_t limit)
+{
+    reset();
+    if (_head == nullptr || _head->size <= limit) {
+        return false;
+    }
+    delete[] reinterpret_cast<char *>(_head);
+    _head = nullptr;
+    _cur = _end = nullptr;
+    return true;
+}
+
+void utils::arena::swap(arena &other)
+{
+    std::swap(_head, other._head);
+    std::swap(_cur, other._cur);
+    std::swap(_end, other._end);
+}
+
+bool utils::iequals(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    auto lower = [](unsigned char c) { return c >= 'A' && c <= 'Z' ? c | 0x20 : c; };
+    for (size_t i = 0; i < a.size(); i++) {
+        if (lower(a[i]) != lower(b[i])) {
+            return false;
         }
     }
+    return true;
+}
 
-    do {
-        auto &front = _pool.front();
-        if (front.storedSize() == 0) {
-            _pool.pop_front();
-        } else {
-            break;
+// BufferPool
+
+BufferPool::BufferPool(const std::vector<size_t> &sizes, size_t maxFree)
+    : _maxFree(maxFree), _mallocs(0), _hits(0), _frees(0), _inUse(0)
+{
+    assert(!sizes.empty());
+    for (auto s : sizes) {
+        assert(s >= sizeof(char *));
+        assert(_classes.empty() || _classes.back().size < s);
+        _classes.push_back({s, nullptr, 0});
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    for (auto &c : _classes) {
+        while (c.free) {
+            auto next = *reinterpret_cast<char **>(c.free);
+            delete[] c.free;
+            c.free = next;
         }
-    } while (_pool.size() > 0);
+    }
+}
 
-    return size;
+size_t BufferPool::classOf(size_t size) const
+{
+    size_t c = 0;
+    while (c + 1 < _classes.size() && _classes[c].size < size) {
+        ++c;
+    }
+    return c;
 }
 
-size_t MemoryBuffer::_Storage::write(const char *at, size_t size)
+char *BufferPool::acquire(size_t c)
 {
-    auto remain = remainSize();
-    auto wrote = std::min(size, remain);
-    memcpy(_end, at, wrote);
-    _end += wrote;
+    assert(c < _classes.size());
+    auto &cls = _classes[c];
+    bump(_inUse);
+    if (cls.free) {
+        auto ret = cls.free;
+        cls.free = *reinterpret_cast<char **>(ret);
+        --cls.freeCount;
+        bump(_hits);
+        return ret;
+    }
+    bump(_mallocs);
+    return new char[cls.size];
+}
 
-    assert(_end <= _ptr + _pageSize);
+void BufferPool::release(char *buf, size_t size)
+{
+    auto &cls = _classes[classOf(size)];
+    assert(cls.size == size);
+    bump(_inUse, -1);
+    if (cls.freeCount >= _maxFree) {
+        bump(_frees);
+        delete[] buf;
+    } else {
+        *reinterpret_cast<char **>(buf) = cls.free;
+        cls.free = buf;
+        ++cls.freeCount;
+    }
+}
 
-    return wrote;
+whs::BufferPoolStats BufferPool::stats() const
+{
+    return {_mallocs.load(std::memory_order_relaxed),
+            _hits.load(std::memory_order_relaxed),
+            _frees.load(std::memory_order_relaxed),
+            _inUse.load(std::memory_order_relaxed)};
 }
 
-size_t MemoryBuffer::_Storage::read(char *dest, size_t size)
+DateCache::DateCache() : _second(-1), _driven(false)
 {
-    auto stored = storedSize();
-    auto readSize = std::min(size, stored);
-    memcpy(dest, _begin, readSize);
-    _begin += readSize;
+    memcpy(_line, _prefix, sizeof(_prefix) - 1);
+    _line[sizeof(_line) - 2] = '\r';
+    _line[sizeof(_line) - 1] = '\n';
+}
 
-    assert(_begin <= _end);
-    assert(_end <= _ptr + _pageSize);
+DateCache &DateCache::local()
+{
+    static thread_local DateCache cache;
+    return cache;
+}
 
-    return readSize;
+void DateCache::refresh()
+{
+    // not time(): it may read a coarse clock lagging behind the timer waking us up
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec;
+    if (now != _second) {
+        struct tm t;
+        gmtime_r(&now, &t);
+        utils::format_time(&t, _line + sizeof(_prefix) - 1);
+        _second = now;
+    }
 }
 
 namespace
@@ -130,20 +285,8 @@ namespace
     namespace __internal
     {
         utils::regex *paramRE = nullptr;
-        utils::regex *queryRE = nullptr;
     }  // namespace __internal
 
-    utils::regex *getQueryStringRegex()
-    {
-        if (__internal::queryRE == nullptr) {
-            __internal::queryRE =
-                utils::regex::compile("(\\?|\\&)(?<name>[^=]+)\\=(?<value>[^&]*)");
-            assert(__internal::queryRE);
-            atexit([]() { delete __internal::queryRE; });
-        }
-        return __internal::queryRE;
-    }
-
 
     utils::regex *getParamParseRegex()
     {
@@ -158,26 +301,271 @@ namespace
         }
         return __internal::paramRE;
     }
+
+    int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        c |= 0x20;
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        return -1;
+    }
+
+    // '+' is a space, %XX a byte. A '%' not followed by two hex digits is kept as is.
+    // Components without either are returned as they are, the others decoded into `out'
+    std::string_view decodeQueryComponent(std::string_view s, utils::arena &out)
+    {
+        size_t i = 0;
+        while (i < s.size() && s[i] != '%' && s[i] != '+') {
+            ++i;
+        }
+        if (i == s.size()) {
+            return s;
+        }
+        // decoding never makes a component longer
+        char *buf = out.allocate(s.size());
+        memcpy(buf, s.data(), i);
+        char *w = buf + i;
+        for (; i < s.size(); ++i) {
+            char c = s[i];
+            if (c == '+') {
+                c = ' ';
+            } else if (c == '%' && i + 2 < s.size()) {
+                int hi = hexValue(s[i + 1]), lo = hexValue(s[i + 2]);
+                if (hi >= 0 && lo >= 0) {
+                    c = static_cast<char>(hi << 4 | lo);
+                    i += 2;
+                }
+            }
+            *w++ = c;
+        }
+        return std::string_view(buf, w - buf);
+    }
 }  // namespace
 
 
 namespace whs::utils
 {
+    void parseQueryString(std::string_view query,
+                          arena &out,
+                          std::vector<std::pair<std::string_view, std::string_view>> &pairs)
+    {
+        const char *p = query.data();
+        const char *end = p + query.size();
+        while (p < end) {
+            auto amp = static_cast<const char *>(memchr(p, '&', end - p));
+            if (amp == nullptr) {
+                amp = end;
+            }
+            std::string_view pair(p, amp - p);
+            p = amp + 1;
+
+            auto eq = pair.find('=');
+            auto name = decodeQueryComponent(pair.substr(0, eq), out);
+            if (name.empty()) {
+                continue;
+            }
+            std::string_view value;
+            if (eq != std::string_view::npos) {
+                value = decodeQueryComponent(pair.substr(eq + 1), out);
+            }
+            // the first of repeated names wins
+            bool exists = false;
+            for (const auto &q : pairs) {
+                if (q.first == name) {
+                    exists = true;
+                    break;
+                }
+            }
+            if (!exists) {
+                pairs.emplace_back(name, value);
+            }
+        }
+    }
+
     bool parseQueryString(const std::string &query, std::map<std::string, std::string> &dict)
     {
-        auto re = getQueryStringRegex();
-        utils::regex::regex_group_match matches;
-        auto status = re->execute(query, matches);
-        if (status) {
-            for (auto &n : matches) {
-                auto name = n.named_matches["name"];
-                auto value = n.named_matches["value"];
-                dict.emplace(move(name), move(value));
+        std::string_view q(query);
+        if (!q.empty() && q[0] == '?') {
+            q.remove_prefix(1);
+        }
+        arena out;
+        std::vector<std::pair<std::string_view, std::string_view>> pairs;
+        parseQueryString(q, out, pairs);
+        for (const auto &pair : pairs) {
+            dict.emplace(pair.first, pair.second);
+        }
+        return !pairs.empty();
+    }
+
+    RangeResult parseRanges(std::string_view value, uint64_t size, std::vector<ByteRange> &ranges)
+    {
+        constexpr std::string_view unit = "bytes=";
+        if (value.size() < unit.size() || !iequals(value.substr(0, unit.size()), unit)) {
+            return RangeResult::Ignore;
+        }
+        value.remove_prefix(unit.size());
+
+        auto number = [](std::string_view s, uint64_t &n) {
+            auto end = s.data() + s.size();
+            auto r = std::from_chars(s.data(), end, n);
+            return !s.empty() && r.ec == std::errc() && r.ptr == end;
+        };
+        size_t specs = 0;
+        while (true) {
+            auto comma = value.find(',');
+            auto spec = value.substr(0, comma);
+            while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) {
+                spec.remove_prefix(1);
+            }
+            while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) {
+                spec.remove_suffix(1);
+            }
+            // empty list elements are allowed
+            if (!spec.empty()) {
+                if (++specs > MAX_RANGES) {
+                    return RangeResult::Ignore;
+                }
+                auto dash = spec.find('-');
+                if (dash == std::string_view::npos) {
+                    return RangeResult::Ignore;
+                }
+                uint64_t first, last = UINT64_MAX;
+                auto tail = spec.substr(dash + 1);
+                if (dash == 0) {
+                    // the last `last' bytes
+                    if (!number(tail, last)) {
+                        return RangeResult::Ignore;
+                    }
+                    if (last != 0 && size != 0) {
+                        ranges.push_back({size - std::min(last, size), size - 1});
+                    }
+                } else {
+                    if (!number(spec.substr(0, dash), first)
+                        || (!tail.empty() && (!number(tail, last) || last < first))) {
+                        return RangeResult::Ignore;
+                    }
+                    if (first < size) {
+                        ranges.push_back({first, std::min(last, size - 1)});
+                    }
+                }
+            }
+            if (comma == std::string_view::npos) {
+                break;
             }
+            value.remove_prefix(comma + 1);
         }
-        return status;
+        if (specs == 0) {
+            return RangeResult::Ignore;
+        }
+        return ranges.empty() ? RangeResult::Unsatisfiable : RangeResult::Satisfiable;
     }
 
+    bool noneMatchHits(std::string_view value, std::string_view etag)
+    {
+        auto trim = [](std::string_view s) {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+                s.remove_prefix(1);
+            }
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+                s.remove_suffix(1);
+            }
+            return s;
+        };
+        value = trim(value);
+        if (value == "*") {
+            return true;
+        }
+        while (!value.empty()) {
+            // entity-tags are quoted and hold no '"', so the next comma ends the element
+            auto comma = value.find(',');
+            auto tag = trim(value.substr(0, comma));
+            if (tag.size() > 2 && tag[0] == 'W' && tag[1] == '/') {
+                tag.remove_prefix(2);
+            }
+            if (tag == etag) {
+                return true;
+            }
+            if (comma == std::string_view::npos) {
+                break;
+            }
+            value.remove_prefix(comma + 1);
+        }
+        return false;
+    }
+
+    int negotiateEncoding(std::string_view accept, const std::string_view *codings, size_t count)
+    {
+        constexpr size_t maxCodings = 8;
+        assert(count <= maxCodings);
+        // q-values in thousandths, -1 for codings not listed
+        int q[maxCodings];
+        std::fill(q, q + count, -1);
+        int any = -1;
+
+        auto trim = [](std::string_view s) {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+                s.remove_prefix(1);
+            }
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+                s.remove_suffix(1);
+            }
+            return s;
+        };
+        // "1", "0.5", "0.125": anything else counts as 1
+        auto qvalue = [](std::string_view v) {
+            if (v.empty() || v[0] != '0') {
+                return 1000;
+            }
+            int ret = 0, scale = 100;
+            for (size_t i = 2; i < v.size() && i < 5 && v[i] >= '0' && v[i] <= '9'; ++i) {
+                ret += (v[i] - '0') * scale;
+                scale /= 10;
+            }
+            return ret;
+        };
+
+        while (!accept.empty()) {
+            auto comma = accept.find(',');
+            auto element = accept.substr(0, comma);
+            accept.remove_prefix(comma == std::string_view::npos ? accept.size() : comma + 1);
+
+            auto semicolon = element.find(';');
+            auto token = trim(element.substr(0, semicolon));
+            int weight = 1000;
+            while (semicolon != std::string_view::npos) {
+                element.remove_prefix(semicolon + 1);
+                semicolon = element.find(';');
+                auto param = trim(element.substr(0, semicolon));
+                if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                    weight = qvalue(trim(param.substr(2)));
+                }
+            }
+            if (token == "*") {
+                any = weight;
+                continue;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (iequals(token, codings[i])
+                    || (codings[i] == "gzip" && iequals(token, "x-gzip"))) {
+                    q[i] = weight;
+                }
+            }
+        }
+
+        int best = -1, bestQ = 0;
+        for (size_t i = 0; i < count; ++i) {
+            int weight = q[i] == -1 ? any : q[i];
+            if (weight > bestQ) {
+                best = static_cast<int>(i);
+                bestQ = weight;
+            }
+        }
+        return best;
+    }
 
     bool parseParam(const std::string &param, std::string &paramName, utils::regex &reg)
     {
@@ -248,34 +636,43 @@ namespace whs::utils
 }  // namespace whs::utils
 
 
-#define _BuildHeader(ch, str) \
-    {                         \
-        CommonHeader::ch, str \
-    }
-
-#define _BuildHeaderString(ch) _BuildHeader(ch, #ch)
+namespace
+{
+    // indexed by CommonHeader
+    const std::string commonHeaderNames[] = {"Host",
+                                             "Connection",
+                                             "Cache-Control",
+                                             "User-Agent",
+                                             "Accept",
+                                             "Accept-Encoding",
+                                             "Accept-Language",
+                                             "Content-Encoding",
+                                             "Last-Modified",
+                                             "Etag",
+                                             "Content-Type",
+                                             "Content-Length",
+                                             "Date",
+                                             "Expires",
+                                             "Server",
+                                             "X-Api-Version",
+                                             "X-Powered-by"};
+    static_assert(sizeof(commonHeaderNames) / sizeof(commonHeaderNames[0])
+                  == utils::CommonHeaderCount);
+}  // namespace
 
 const std::string &whs::utils::mapCommonHeader(CommonHeader h)
 {
-    const static std::unordered_map<CommonHeader, string> _m = {
-        _BuildHeaderString(Host),
-        _BuildHeaderString(Connection),
-        _BuildHeaderString(Accept),
-        _BuildHeaderString(Date),
-        _BuildHeaderString(Server),
-        _BuildHeaderString(Expires),
-        _BuildHeaderString(Etag),
-        _BuildHeader(LastModified, "Last-Modified"),
-        _BuildHeader(AcceptEncoding, "Accept-Encoding"),
-        _BuildHeader(AcceptLanguage, "Accept-Language"),
-        _BuildHeader(ContentEncoding, "Content-Encoding"),
-        _BuildHeader(ContentType, "Content-Type"),
-        _BuildHeader(CacheControl, "Cache-Control"),
-        _BuildHeader(UserAgent, "User-Agent"),
-        _BuildHeader(XApiVersion, "X-Api-Version"),
-        _BuildHeader(XPoweredBy, "X-Powered-by"),
-        _BuildHeader(ContentLength, "Content-Length")};
-    auto f = _m.find(h);
-    assert(f != _m.end());
-    return f->second;
-}
\ No newline at end of file
+    assert(static_cast<size_t>(h) < CommonHeaderCount);
+    return commonHeaderNames[static_cast<size_t>(h)];
+}
+
+bool whs::utils::findCommonHeader(std::string_view name, CommonHeader &h)
+{
+    for (size_t i = 0; i < CommonHeaderCount; ++i) {
+        if (iequals(commonHeaderNames[i], name)) {
+            h = static_cast<CommonHeader>(i);
+            return true;
+        }
+    }
+    return false;
+}
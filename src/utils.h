@@ -2,81 +2,188 @@
 #define WHS_UTILS_H
 
 #include <cstdlib>
+#include <ctime>
+#include <atomic>
+#include <string_view>
+#include <vector>
 
 #include "config.h"
+#include "whs/common.h"
 
 namespace whsutils
 {
+    /**
+     * @brief MemoryBuffer: bytes written at the back, read from the front, kept contiguous in one
+     * block, which grows by doubling. Reads and clear() keep the block, so a buffer reused by a
+     * connection stops allocating once it holds its largest message.
+     */
     class MemoryBuffer
     {
-        static const size_t _pageSize = 512;
+        static const size_t _minCapacity = 512;
 
-        struct _Storage {
-            _Storage(const _Storage &) = delete;
-
-            char *_ptr;
-            char *_end;
-            char *_begin;
-
-            ~_Storage()
-            {
-                if (_ptr) {
-                    delete[] _ptr;
-                }
-            }
-
-            size_t remainSize() const
-            {
-                return _ptr + _pageSize - _end;
-            }
-
-            size_t storedSize() const
-            {
-                return _end - _begin;
-            }
-
-            _Storage(_Storage &&s)
-            {
-                _ptr = s._ptr;
-                _begin = s._begin;
-                _end = s._end;
-                s._ptr = nullptr;
-            }
+        char *_ptr;
+        size_t _begin;  // first stored byte
+        size_t _end;    // past the last stored byte
+        size_t _capacity;
+        size_t _gcount;
 
-            _Storage()
-            {
-                _begin = _end = _ptr = new char[_pageSize];
-            }
+        // room for `size' more bytes at the back
+        void reserve(size_t size);
 
-            size_t write(const char *, size_t);
-            size_t read(char *, size_t);
-        };
+    public:
+        MemoryBuffer(const MemoryBuffer &) = delete;
+        MemoryBuffer &operator=(const MemoryBuffer &) = delete;
 
-        std::deque<_Storage> _pool;
+        MemoryBuffer() : _ptr(nullptr), _begin(0), _end(0), _capacity(0), _gcount(0) {}
 
-        size_t _stored;
-        size_t _gcount;
+        ~MemoryBuffer()
+        {
+            delete[] _ptr;
+        }
 
-    public:
         size_t gcount() const
         {
             return _gcount;
         }
         size_t stored() const
         {
-            return _stored;
+            return _end - _begin;
         }
         operator bool()
         {
             return true;
         }
 
-        MemoryBuffer() : _stored(0), _gcount(0) {}
+        // the stored bytes, valid until the next write, read or clear
+        const char *data() const
+        {
+            return _ptr + _begin;
+        }
+
+        void clear()
+        {
+            _begin = _end = _gcount = 0;
+        }
+
+        // give the capacity back if it grew over `limit' bytes, keeping what is stored. Whether
+        // it did
+        bool shrink(size_t limit);
 
-        void clear();
         size_t write(const char *, size_t);
         size_t read(char *, size_t &);
     };
+
+    /**
+     * @brief BufferPool: size-classed slab free lists, owned by one event loop.
+     *
+     * Slabs are handed out by acquire() and must go back through release() with the same size.
+     * Free slabs are linked through their first bytes, so a warm pool never touches the heap.
+     * Not thread-safe except stats(), which may be read from any thread.
+     */
+    class BufferPool
+    {
+        struct _Class {
+            size_t size;
+            char *free;
+            size_t freeCount;
+        };
+
+        std::vector<_Class> _classes;
+        size_t _maxFree;
+
+        std::atomic<size_t> _mallocs;
+        std::atomic<size_t> _hits;
+        std::atomic<size_t> _frees;
+        std::atomic<size_t> _inUse;
+
+        // single writer: avoid locked read-modify-write on the hot path
+        static void bump(std::atomic<size_t> &c, std::ptrdiff_t d = 1)
+        {
+            c.store(c.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+        }
+
+    public:
+        static constexpr size_t defaultSizes[] = {4 << 10, 16 << 10, 64 << 10};
+
+        BufferPool(const BufferPool &) = delete;
+        BufferPool &operator=(const BufferPool &) = delete;
+
+        // sizes: slab size of each class, ascending. maxFree: free slabs kept per class
+        BufferPool(const std::vector<size_t> &sizes, size_t maxFree = 256);
+        ~BufferPool();
+
+        size_t classCount() const
+        {
+            return _classes.size();
+        }
+
+        size_t classSize(size_t c) const
+        {
+            return _classes[c].size;
+        }
+
+        // smallest class whose slab holds `size' bytes, or the largest class
+        size_t classOf(size_t size) const;
+
+        char *acquire(size_t c);
+        void release(char *, size_t size);
+
+        whs::BufferPoolStats stats() const;
+    };
+
+    /**
+     * @brief DateCache: the "Date" response header of the current second, formatted once per
+     * second instead of once per response.
+     *
+     * One instance per thread, see local(). A libuv worker refreshes the instance of its thread
+     * from a loop timer and marks it driven, so line() is a plain load there. Anywhere else
+     * line() checks the clock and formats again when the second changed.
+     */
+    class DateCache
+    {
+    public:
+        // IMF-fixdate, as written by utils::format_time
+        static constexpr size_t DATE_LENGTH = 29;
+
+    private:
+        static constexpr char _prefix[] = "Date: ";
+
+        // Date: <IMF-fixdate>\r\n
+        char _line[sizeof(_prefix) - 1 + DATE_LENGTH + 2];
+        time_t _second;
+        bool _driven;
+
+    public:
+        DateCache(const DateCache &) = delete;
+        DateCache &operator=(const DateCache &) = delete;
+
+        DateCache();
+
+        static DateCache &local();
+
+        // format the current time if the second changed
+        void refresh();
+
+        // driven: refresh() is called by a timer at least once per second
+        void drive(bool driven)
+        {
+            _driven = driven;
+        }
+
+        // the whole header line, CRLF included
+        std::string_view line()
+        {
+            if (!_driven) {
+                refresh();
+            }
+            return std::string_view(_line, sizeof(_line));
+        }
+
+        std::string_view date()
+        {
+            return line().substr(sizeof(_prefix) - 1, DATE_LENGTH);
+        }
+    };
 }  // namespace whsutils
 
 
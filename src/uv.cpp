@@ -2,7 +2,15 @@
 #ifdef ENABLE_LIBUV
 
 #include <functional>
+#include <iterator>
+#include <thread>
 #include <uv.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "client.h"
 #include "fmt/format.h"
 
@@ -13,25 +21,595 @@ using uv = whs::LibuvWhs;
 using ust = uv_stream_t;
 using utt = uv_tcp_t;
 
+namespace
+{
+    struct two;
+}
+
+namespace whs::utils
+{
+    struct WriteRequest;
+    struct Reactor;
+
+    // the reactor whose loop runs on this thread
+    thread_local Reactor *currentReactor = nullptr;
+
+    /**
+     * @brief Reactor: one event loop of LibuvWhs, with its own listening socket.
+     *
+     */
+    struct Reactor {
+        LibuvWhs *owner;
+        uv_loop_s *loop;
+        uv_tcp_t server;
+        uv_async_t stop_async;
+        uv_timer_t date_timer;
+        uv_thread_t thread;
+        unsigned int index;
+        whsutils::BufferPool *pool;
+
+        // recycled write requests, only touched by the loop thread
+        WriteRequest *freeWrites;
+        size_t freeWriteCount;
+
+        // closed connections kept for reuse, at most `maxFreeConnections'
+        two *freeConnections;
+        size_t freeConnectionCount;
+        size_t maxFreeConnections;
+        ConnectionPoolStats connections;
+
+        // deferred responses of this loop, at most `deferredDepth' pending on the thread pool
+        DeferredStats deferred;
+        size_t deferredDepth;
+
+        // work posted by other threads, newest first, run by `post_async'
+        std::atomic<Posted *> posted;
+        uv_async_t post_async;
+        // posts announced, `post_async' keeps the loop alive meanwhile
+        size_t expected;
+    };
+
+    /**
+     * @brief WriteRequest: one response on its way to the network, recycled by its reactor.
+     *
+     * Runs of memory chunks go out with a single vectored uv_write, file chunks with sendfile.
+     * Chunks are released when the whole response is sent. A response head that fits is
+     * serialized into `head', so a recycled request writes a response without allocating.
+     */
+    struct WriteRequest {
+        static constexpr size_t inlineHead = 1024;
+
+        uv_write_t req;
+        WriteRequest *next;  // send queue of the connection, or free list of the reactor
+        Client *client;
+        Reactor *reactor;
+        size_t sent;    // chunks handed to the socket
+        bool writing;   // `req' is in flight
+        // a deferred response being completed, nothing is sent until then
+        Response *deferred;
+        std::vector<BodyChunk> chunks;
+        char head[inlineHead];
+    };
+}  // namespace whs::utils
 
 namespace
 {
+    // free requests kept by a reactor, the others are deleted when released
+    constexpr size_t maxFreeWrites = 256;
+    // larger buffers of a pooled connection, left by a large message, are freed on recycle
+    constexpr size_t maxPooledBuffer = 64 << 10;
+
+    struct FileSend;
+
+    /**
+     * @brief two: a connection, with its handle and Client. Recycled by its reactor, allocated
+     * together with them and kept so.
+     */
     struct two {
         LibuvWhs *server;
         Client *client;
         uv_tcp_t *tcp;
+        utils::Reactor *reactor;
+        size_t readClass;
+        // free list of the reactor
+        two *next;
+
+        // responses not completely handed to the socket, in order
+        utils::WriteRequest *sendHead;
+        utils::WriteRequest *sendTail;
+        // uv_writes in flight, a file chunk waits for them
+        size_t writing;
+        // file chunk being sent, nullptr if none
+        FileSend *file;
+        // deferred responses on the thread pool
+        size_t jobs;
+        // the handle is closed, the connection goes away once idle()
+        bool closed;
+        // close once everything is sent
+        bool closeWhenIdle;
+        // reading stopped while a request is suspended
+        bool paused;
     };
-    void uvAllocCB(uv_handle_t *, size_t, uv_buf_t *buf)
+
+    /**
+     * @brief FileSend: a file chunk being sent with uv_fs_sendfile.
+     *
+     * The thread pool writes to a dup of the socket, so that closing the connection meanwhile
+     * cannot redirect the bytes to a reused descriptor. When the socket is full, `poll' waits for
+     * it to become writable again.
+     */
+    struct FileSend {
+        uv_fs_t req;
+        uv_poll_t poll;
+        two *twos;
+        const BodyChunk *chunk;
+        int out;
+        int64_t offset;
+        size_t remaining;
+        bool inFlight;  // `req' is on the thread pool
+        bool polling;   // `poll' is initialized
+    };
+
+    // a deferred response on the thread pool, `w' waits for it in the send queue
+    struct DeferredWork {
+        uv_work_t req;
+        Deferred *job;
+        utils::WriteRequest *w;
+    };
+    void uvAllocCB(uv_handle_t *h, size_t, uv_buf_t *buf)
     {
-        buf->len = 512;
-        buf->base = new char[buf->len];
+        auto twos = reinterpret_cast<two *>(h->data);
+        auto pool = twos->reactor->pool;
+        buf->base = pool->acquire(twos->readClass);
+        buf->len = pool->classSize(twos->readClass);
     }
-    void uvCloseCB(uv_handle_t *h)
+    void releaseWrite(utils::WriteRequest *);
+    void finishFile(FileSend *, bool);
+
+    // nothing but the handle uses the connection
+    bool idle(const two *twos)
+    {
+        return twos->file == nullptr && twos->jobs == 0 && !twos->client->suspended();
+    }
+
+    two *newConnection(utils::Reactor *r)
+    {
+        auto twos = new two;
+        twos->server = r->owner;
+        twos->reactor = r;
+        twos->tcp = new uv_tcp_t;
+        twos->client = new Client(r->owner, twos);
+        return twos;
+    }
+
+    void deleteConnection(two *twos)
     {
-        auto twos = reinterpret_cast<two *>(h->data);
         delete twos->client;
+        delete twos->tcp;
         delete twos;
-        delete reinterpret_cast<uv_tcp_t *>(h);
+    }
+
+    // a connection of `r', from its pool if possible
+    two *acquireConnection(utils::Reactor *r)
+    {
+        auto twos = r->freeConnections;
+        if (twos != nullptr) {
+            r->freeConnections = twos->next;
+            --r->freeConnectionCount;
+            ++r->connections.hits;
+        } else {
+            twos = newConnection(r);
+            ++r->connections.growths;
+        }
+        ++r->connections.inUse;
+        twos->readClass = 0;
+        twos->next = nullptr;
+        twos->sendHead = twos->sendTail = nullptr;
+        twos->writing = 0;
+        twos->file = nullptr;
+        twos->jobs = 0;
+        twos->closed = false;
+        twos->closeWhenIdle = false;
+        twos->paused = false;
+        return twos;
+    }
+
+    // the handle is closed and nothing uses the connection anymore: recycle it
+    void freeConnection(two *twos)
+    {
+        while (auto w = twos->sendHead) {
+            twos->sendHead = w->next;
+            releaseWrite(w);
+        }
+        auto r = twos->reactor;
+        --r->connections.inUse;
+        if (r->freeConnectionCount < r->maxFreeConnections) {
+            twos->client->reset();
+            if (twos->client->shrink(maxPooledBuffer)) {
+                ++r->connections.trims;
+            }
+            twos->next = r->freeConnections;
+            r->freeConnections = twos;
+            ++r->freeConnectionCount;
+        } else {
+            ++r->connections.frees;
+            deleteConnection(twos);
+        }
+    }
+
+    void uvCloseCB(uv_handle_t *h)
+    {
+        auto twos = reinterpret_cast<two *>(h->data);
+        twos->closed = true;
+        if (twos->file != nullptr) {
+            // a pending sendfile still uses the connection: finishFile frees it
+            if (!twos->file->inFlight) {
+                finishFile(twos->file, false);
+            }
+            return;
+        }
+        // else the last deferred response to complete, or the suspended request, frees it
+        if (idle(twos)) {
+            freeConnection(twos);
+        }
+    }
+
+    void abortConnection(two *twos)
+    {
+        auto h = reinterpret_cast<uv_handle_t *>(twos->tcp);
+        if (!uv_is_closing(h)) {
+            uv_close(h, uvCloseCB);
+        }
+    }
+
+    // refresh the Date cache of the loop thread, then sleep until the next second begins
+    void uvDateTimerCB(uv_timer_t *t)
+    {
+        auto &cache = whsutils::DateCache::local();
+        cache.refresh();
+        cache.drive(true);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uv_timer_start(t, uvDateTimerCB, 1000 - now.tv_nsec / 1000000 + 1, 0);
+    }
+
+    // shutdown the write side after all pending writes are flushed, then close the connection
+    int uvShutdownClose(uv_stream_t *tcp)
+    {
+        auto shutdown = new uv_shutdown_t;
+        shutdown->data = tcp;
+        auto status = uv_shutdown(shutdown, tcp, [](uv_shutdown_t *shut, int) {
+            auto tcp = reinterpret_cast<uv_handle_t *>(shut->data);
+            if (!uv_is_closing(tcp)) {
+                uv_close(tcp, uvCloseCB);
+            }
+            delete shut;
+        });
+        if (status != 0) {
+            delete shutdown;
+        }
+        return status;
+    }
+
+    void releaseArray(const BodyChunk &c)
+    {
+        delete[] c.data;
+    }
+
+    utils::WriteRequest *acquireWrite(utils::Reactor *r, Client *c)
+    {
+        auto w = r->freeWrites;
+        if (w != nullptr) {
+            r->freeWrites = w->next;
+            --r->freeWriteCount;
+        } else {
+            w = new utils::WriteRequest;
+            w->req.data = w;
+            w->reactor = r;
+            w->chunks.reserve(4);
+        }
+        w->next = nullptr;
+        w->client = c;
+        w->sent = 0;
+        w->writing = false;
+        w->deferred = nullptr;
+        return w;
+    }
+
+    // release the chunks of `w', then recycle it
+    void releaseWrite(utils::WriteRequest *w)
+    {
+        for (const auto &c : w->chunks) {
+            if (c.release != nullptr) {
+                c.release(c);
+            }
+        }
+        w->chunks.clear();
+        auto r = w->reactor;
+        if (r->freeWriteCount < maxFreeWrites) {
+            w->next = r->freeWrites;
+            r->freeWrites = w;
+            ++r->freeWriteCount;
+        } else {
+            delete w;
+        }
+    }
+
+    void pump(two *);
+
+    void uvWriteCB(uv_write_t *req, int)
+    {
+        auto w = reinterpret_cast<utils::WriteRequest *>(req->data);
+        auto twos = reinterpret_cast<two *>(w->client->get_data());
+        w->writing = false;
+        --twos->writing;
+        // out of the queue once its last chunk is written
+        if (w->sent == w->chunks.size()) {
+            releaseWrite(w);
+        }
+        pump(twos);
+    }
+
+    void submitFile(FileSend *);
+
+    void uvFilePollCB(uv_poll_t *h, int status, int)
+    {
+        auto f = reinterpret_cast<FileSend *>(h->data);
+        uv_poll_stop(h);
+        if (status < 0) {
+            finishFile(f, false);
+        } else {
+            submitFile(f);
+        }
+    }
+
+    void uvFileSentCB(uv_fs_t *req)
+    {
+        auto f = reinterpret_cast<FileSend *>(req->data);
+        auto result = req->result;
+        uv_fs_req_cleanup(req);
+        f->inFlight = false;
+        if (f->twos->closed) {
+            finishFile(f, false);
+        } else if (result > 0) {
+            f->offset += result;
+            f->remaining -= result;
+            if (f->remaining == 0) {
+                finishFile(f, true);
+            } else {
+                submitFile(f);
+            }
+        } else if (result == UV_EAGAIN) {
+            // the socket is full
+            if (!f->polling) {
+                uv_poll_init(f->twos->reactor->loop, &f->poll, f->out);
+                f->poll.data = f;
+                f->polling = true;
+            }
+            uv_poll_start(&f->poll, UV_WRITABLE, uvFilePollCB);
+        } else {
+            warning(fmt::format("whs-uv: [sendfile] failed: {}",
+                                result == 0 ? "file truncated" : uv_strerror(result)));
+            finishFile(f, false);
+        }
+    }
+
+    void submitFile(FileSend *f)
+    {
+        f->inFlight = true;
+        auto status = uv_fs_sendfile(f->twos->reactor->loop,
+                                     &f->req,
+                                     f->out,
+                                     f->chunk->fd,
+                                     f->offset,
+                                     f->remaining,
+                                     uvFileSentCB);
+        if (status != 0) {
+            f->inFlight = false;
+            warning(fmt::format("whs-uv: [sendfile] failed: {}", uv_strerror(status)));
+            finishFile(f, false);
+        }
+    }
+
+    void startFile(two *twos, const BodyChunk &c)
+    {
+        uv_os_fd_t fd;
+        int out = -1;
+        if (uv_fileno(reinterpret_cast<uv_handle_t *>(twos->tcp), &fd) == 0) {
+            out = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        }
+        if (out < 0) {
+            warning(fmt::format("whs-uv: [sendfile] cannot duplicate socket: {}", strerror(errno)));
+            abortConnection(twos);
+            return;
+        }
+        auto f = new FileSend;
+        f->req.data = f;
+        f->twos = twos;
+        f->chunk = &c;
+        f->out = out;
+        f->offset = c.offset;
+        f->remaining = c.size;
+        f->inFlight = false;
+        f->polling = false;
+        twos->file = f;
+        if (c.size == 0) {
+            finishFile(f, true);
+        } else {
+            submitFile(f);
+        }
+    }
+
+    // the file chunk is sent (`ok'), or the connection has to go
+    void finishFile(FileSend *f, bool ok)
+    {
+        auto twos = f->twos;
+        twos->file = nullptr;
+        if (f->polling) {
+            uv_close(reinterpret_cast<uv_handle_t *>(&f->poll), [](uv_handle_t *h) {
+                auto f = reinterpret_cast<FileSend *>(h->data);
+                close(f->out);
+                delete f;
+            });
+        } else {
+            close(f->out);
+            delete f;
+        }
+        if (twos->closed) {
+            if (idle(twos)) {
+                freeConnection(twos);
+            }
+        } else if (!ok) {
+            abortConnection(twos);
+        } else {
+            ++twos->sendHead->sent;
+            pump(twos);
+        }
+    }
+
+    // hand queued chunks to the socket, in order: runs of memory chunks with a vectored
+    // uv_write, a file chunk once all the bytes before it are written
+    void pump(two *twos)
+    {
+        auto tcp = reinterpret_cast<ust *>(twos->tcp);
+        if (uv_is_closing(reinterpret_cast<uv_handle_t *>(tcp))) {
+            return;
+        }
+        while (auto w = twos->sendHead) {
+            if (twos->file != nullptr || w->writing || w->deferred != nullptr) {
+                return;
+            }
+            auto count = w->chunks.size();
+            if (w->sent == count) {
+                twos->sendHead = w->next;
+                releaseWrite(w);
+                continue;
+            }
+            if (w->chunks[w->sent].fd != -1) {
+                if (twos->writing == 0) {
+                    startFile(twos, w->chunks[w->sent]);
+                }
+                return;
+            }
+            auto end = w->sent;
+            while (end < count && w->chunks[end].fd == -1) {
+                ++end;
+            }
+            // uv_write copies the buffer array, it only has to live through the call
+            uv_buf_t small[16];
+            std::vector<uv_buf_t> large;
+            auto bufs = small;
+            if (end - w->sent > std::size(small)) {
+                large.resize(end - w->sent);
+                bufs = large.data();
+            }
+            for (auto i = w->sent; i < end; ++i) {
+                const auto &c = w->chunks[i];
+                bufs[i - w->sent] = uv_buf_init(const_cast<char *>(c.data), c.size);
+            }
+            auto status = uv_write(&w->req, tcp, bufs, end - w->sent, uvWriteCB);
+            if (status != 0) {
+                warning(fmt::format("whs-uv: [write] failed: {}", uv_strerror(status)));
+                abortConnection(twos);
+                return;
+            }
+            w->writing = true;
+            ++twos->writing;
+            w->sent = end;
+            if (end == count) {
+                // uvWriteCB releases it, the next response can be written right away
+                twos->sendHead = w->next;
+                continue;
+            }
+            // a file chunk follows: wait for the write
+            return;
+        }
+        // a suspended request has yet to be answered
+        if (twos->writing == 0 && !twos->client->suspended()
+            && (twos->closeWhenIdle || twos->client->connection_should_close())) {
+            twos->closeWhenIdle = false;
+            if (uvShutdownClose(tcp) != 0) {
+                abortConnection(twos);
+            }
+        }
+    }
+
+    // serialize the head of `resp' into `w', and take its body
+    void fill(utils::WriteRequest *w, Response &resp)
+    {
+        auto size = resp.prepareHead();
+        if (size <= sizeof(w->head)) {
+            resp.writeHead(w->head);
+            w->chunks.push_back({w->head, size, nullptr, nullptr});
+        } else {
+            auto head = new char[size];
+            resp.writeHead(head);
+            w->chunks.push_back({head, size, releaseArray, nullptr});
+        }
+        resp.takeBody([w](const BodyChunk &chunk) { w->chunks.push_back(chunk); });
+    }
+
+    void uvDeferredRunCB(uv_work_t *req)
+    {
+        reinterpret_cast<DeferredWork *>(req->data)->job->run();
+    }
+
+    void uvDeferredDoneCB(uv_work_t *req, int)
+    {
+        auto d = reinterpret_cast<DeferredWork *>(req->data);
+        auto w = d->w;
+        auto twos = reinterpret_cast<two *>(w->client->get_data());
+        --twos->jobs;
+        --twos->reactor->deferred.pending;
+        d->job->complete(*w->deferred);
+        if (!twos->closed) {
+            fill(w, *w->deferred);
+        }
+        delete w->deferred;
+        w->deferred = nullptr;
+        delete d->job;
+        delete d;
+        if (!twos->closed) {
+            pump(twos);
+        } else if (idle(twos)) {
+            freeConnection(twos);
+        }
+    }
+
+    // run the Deferred of `resp' on the thread pool, false if the queue is full
+    bool queue(utils::WriteRequest *w, Response &resp)
+    {
+        auto twos = reinterpret_cast<two *>(w->client->get_data());
+        auto r = twos->reactor;
+        if (r->deferred.pending >= r->deferredDepth) {
+            return false;
+        }
+        auto d = new DeferredWork;
+        d->req.data = d;
+        d->job = resp.takeDeferred();
+        d->w = w;
+        if (uv_queue_work(r->loop, &d->req, uvDeferredRunCB, uvDeferredDoneCB) != 0) {
+            resp.defer(d->job);
+            delete d;
+            return false;
+        }
+        w->deferred = new Response(std::move(resp));
+        ++twos->jobs;
+        ++r->deferred.queued;
+        r->deferred.peak = std::max(r->deferred.peak, ++r->deferred.pending);
+        return true;
+    }
+
+    void send(utils::WriteRequest *w)
+    {
+        auto twos = reinterpret_cast<two *>(w->client->get_data());
+        if (twos->sendHead == nullptr) {
+            twos->sendHead = w;
+        } else {
+            twos->sendTail->next = w;
+        }
+        twos->sendTail = w;
+        pump(twos);
     }
 }  // namespace
 
@@ -54,42 +632,95 @@ namespace whs::utils
         } else if (nread == 0) {
             // empty body
         } else {
-            twos->client->read_from_network(nread, buf->base);
+            try {
+                twos->client->read_from_network(nread, buf->base);
+                if (twos->client->suspended()) {
+                    // the rest of the buffer is held by the parser, further bytes wait in the
+                    // socket until the request resumes
+                    uv_read_stop(client);
+                    twos->paused = true;
+                }
+            } catch (const HttpParserException &e) {
+                warning(fmt::format("whs-uv: [read] bad request: {}", e.getErrorCode()));
+                uv_read_stop(client);
+                uv_close((uv_handle_t *)client, uvCloseCB);
+            }
+        }
+        if (buf->base != nullptr) {
+            auto pool = twos->reactor->pool;
+            auto c = twos->readClass;
+            // a full slab means more data is likely pending: use a larger class next time
+            if (static_cast<size_t>(nread) == buf->len && c + 1 < pool->classCount()) {
+                twos->readClass = c + 1;
+            } else if (c > 0 && nread >= 0
+                       && static_cast<size_t>(nread) <= pool->classSize(c - 1) / 2) {
+                twos->readClass = c - 1;
+            }
+            pool->release(buf->base, buf->len);
         }
-        delete[] buf->base;
     }
 
     void uvConnectCB(uv_stream_s *server, int flag)
     {
-        auto p = reinterpret_cast<uv *>(server->data);
+        auto r = reinterpret_cast<Reactor *>(server->data);
+        currentReactor = r;
 
         if (flag < 0) {
             warning(fmt::format("whs-uv: [connect] new connection error {}", uv_strerror(flag)));
             return;
         }
-        auto client = new uv_tcp_t;
-        uv_tcp_init(p->loop, client);
-
-        auto twos = new two;
-        twos->server = p;
-        auto c = new Client(p, twos);
-        twos->client = c;
-        twos->tcp = client;
+        auto twos = acquireConnection(r);
+        auto client = twos->tcp;
+        uv_tcp_init(r->loop, client);
         client->data = twos;
 
-        if (auto err = uv_accept(server, reinterpret_cast<ust *>(client)) == 0) {
+        if (auto err = uv_accept(server, reinterpret_cast<ust *>(client)); err == 0) {
+            // a head and a file body go out as separate sends, Nagle would hold the second
+            uv_tcp_nodelay(client, 1);
             uv_read_start(reinterpret_cast<ust *>(client), uvAllocCB, uvReadCB);
         } else {
             warning(fmt::format("whs-uv: [accept] error: {}", uv_strerror(err)));
-            delete client;
+            uv_close(reinterpret_cast<uv_handle_t *>(client), uvCloseCB);
         }
 
-        debug(fmt::format("whs-uv: on connect cb. flag {}", flag));
+        debug(fmt::format("whs-uv: on connect cb. worker {} flag {}", r->index, flag));
     }
 
     void uvAsyncStopCB(uv_async_t *async)
     {
-        reinterpret_cast<uv *>(async->data)->stop_uv();
+        auto r = reinterpret_cast<Reactor *>(async->data);
+        r->owner->stop_uv(*r);
+    }
+
+    static void uvPostCB(uv_async_t *async)
+    {
+        auto r = reinterpret_cast<Reactor *>(async->data);
+        Posted *order = nullptr;
+        for (auto p = r->posted.exchange(nullptr, std::memory_order_acquire); p != nullptr;) {
+            auto next = p->next;
+            p->next = order;
+            order = p;
+            p = next;
+        }
+        while (order != nullptr) {
+            // `run' may free it
+            auto next = order->next;
+            --r->expected;
+            order->run(order);
+            order = next;
+        }
+        if (r->expected == 0) {
+            uv_unref(reinterpret_cast<uv_handle_t *>(async));
+        }
+    }
+
+    // run the loop of `r' until it is stopped and drained
+    static void run(Reactor *r)
+    {
+        uv_run(r->loop, UV_RUN_DEFAULT);
+        // nothing is expected any more
+        uv_close(reinterpret_cast<uv_handle_t *>(&r->post_async), nullptr);
+        uv_run(r->loop, UV_RUN_DEFAULT);
     }
 
 }  // namespace whs::utils
@@ -97,144 +728,353 @@ namespace whs::utils
 bool uv::_setup()
 {
     setup_tcp();
-    if (!externalLoop) {
-        uv_loop_init(loop);
+    // sendfile on the thread pool has no MSG_NOSIGNAL: a peer going away must not kill us
+    signal(SIGPIPE, SIG_IGN);
+    if (externalLoop != nullptr) {
+        workers = 1;
+    }
+    reactors = new utils::Reactor[workers];
+    for (unsigned int i = 0; i < workers; i++) {
+        auto &r = reactors[i];
+        r.owner = this;
+        r.index = i;
+        r.pool = new whsutils::BufferPool(readBufferSizes);
+        r.freeWrites = nullptr;
+        r.freeWriteCount = 0;
+        r.freeConnections = nullptr;
+        r.freeConnectionCount = 0;
+        r.maxFreeConnections = connectionPoolSize;
+        r.connections = {0, 0, 0, 0, 0};
+        for (size_t n = 0; n < connectionPoolSize; ++n) {
+            auto twos = newConnection(&r);
+            twos->next = r.freeConnections;
+            r.freeConnections = twos;
+            ++r.freeConnectionCount;
+        }
+        r.deferred = {0, 0, 0, 0};
+        r.deferredDepth = deferredDepth;
+        if (externalLoop != nullptr) {
+            r.loop = externalLoop;
+        } else {
+            r.loop = new uv_loop_s;
+            uv_loop_init(r.loop);
+        }
+        int status = uv_tcp_init(r.loop, &r.server);
+        if (status != 0) {
+            error(fmt::format("uv_tcp_init on server socket failed: {}", uv_strerror(status)));
+            return false;
+        }
+        r.server.data = &r;
+        uv_timer_init(r.loop, &r.date_timer);
+        uv_timer_start(&r.date_timer, uvDateTimerCB, 0, 0);
+        // the timer alone must not keep an external loop running
+        uv_unref(reinterpret_cast<uv_handle_t *>(&r.date_timer));
+        if (externalLoop == nullptr) {
+            uv_async_init(r.loop, &r.stop_async, utils::uvAsyncStopCB);
+            r.stop_async.data = &r;
+        }
+        r.posted = nullptr;
+        r.expected = 0;
+        uv_async_init(r.loop, &r.post_async, utils::uvPostCB);
+        r.post_async.data = &r;
+        uv_unref(reinterpret_cast<uv_handle_t *>(&r.post_async));
+    }
+    debug(fmt::format("whs: libuv backend setup success, {} worker(s)", workers));
+    return true;
+}
+
+bool uv::listen(utils::Reactor &r)
+{
+    int status = 0;
+    if (workers > 1) {
+        // uv_tcp_bind cannot set SO_REUSEPORT, so every worker binds its own socket
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int on = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+            || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0
+            || bind(fd, reinterpret_cast<struct sockaddr *>(_sock), sizeof(*_sock)) != 0) {
+            status = uv_translate_sys_error(errno);
+            if (fd >= 0) {
+                close(fd);
+            }
+        } else {
+            status = uv_tcp_open(&r.server, fd);
+        }
+    } else {
+        status = uv_tcp_bind(&r.server, reinterpret_cast<struct sockaddr *>(_sock), 0);
     }
-    int status = uv_tcp_init(loop, server);
     if (status != 0) {
-        error(fmt::format("uv_tcp_init failed: {}", uv_strerror(status)));
+        error(fmt::format(
+            "whs: libuv backend bind on {}:{} failed: {}", _host, _port, uv_strerror(status)));
         return false;
     }
-    status = uv_tcp_init(loop, server);
+    debug("whs: libuv backend bind success");
+    status = uv_listen(reinterpret_cast<uv_stream_t *>(&r.server), SOMAXCONN, utils::uvConnectCB);
     if (status != 0) {
-        error(fmt::format("uv_tcp_init on server socket failed: {}", uv_strerror(status)));
+        error(fmt::format(
+            "whs: libuv backend listen on {}:{} failed: {}", _host, _port, uv_strerror(status)));
         return false;
     }
-    debug("whs: libuv backend setup success");
-    if (!externalLoop) {
-        uv_async_init(loop, stop_async, utils::uvAsyncStopCB);
-    }
     return true;
 }
 
 bool uv::init()
 {
-    int status = uv_tcp_bind(server, reinterpret_cast<struct sockaddr *>(_sock), 0);
-    if (!status) {
-        debug("whs: libuv backend bind success");
-        status = uv_listen(reinterpret_cast<uv_stream_t *>(server), 0, utils::uvConnectCB);
-        if (!status) {
-            info(fmt::format("whs: libuv backend is listening on {}:{}", _host, _port));
-        } else {
-            error(fmt::format("whs: libuv backend listen on {}:{} failed: {}",
-                              _host,
-                              _port,
-                              uv_strerror(status)));
+    for (unsigned int i = 0; i < workers; i++) {
+        if (!listen(reactors[i])) {
+            return false;
         }
-    } else {
-        error(fmt::format(
-            "whs: libuv backend bind on {}:{} failed: {}", _host, _port, uv_strerror(errno)));
     }
-    return status;
+    info(fmt::format("whs: libuv backend is listening on {}:{}", _host, _port));
+    return true;
 }
 
-void uv::stop_uv()
+void uv::stop_uv(utils::Reactor &r)
 {
-    if (!externalLoop) {
-        m->lock();
-        uv_read_stop(reinterpret_cast<ust *>(server));
-        if (!externalLoop) {
-            uv_stop(loop);
-            uv_walk(
-                loop, [](uv_handle_t *h, void *) { uv_close((uv_handle_t *)h, nullptr); }, nullptr);
-            uv_loop_close(loop);
-        }
-        m->unlock();
-    }
-    info("whs: libuv backend stopped.");
+    // stop accepting, then let every connection flush its pending writes before closing.
+    // uv_run returns once the last connection of this loop is closed.
+    uv_close(reinterpret_cast<uv_handle_t *>(&r.server), nullptr);
+    uv_close(reinterpret_cast<uv_handle_t *>(&r.stop_async), nullptr);
+    uv_close(reinterpret_cast<uv_handle_t *>(&r.date_timer), nullptr);
+    whsutils::DateCache::local().drive(false);
+    // `post_async' stays open for suspended requests, until the loop returns
+    uv_walk(
+        r.loop,
+        [](uv_handle_t *h, void *arg) {
+            auto r = reinterpret_cast<utils::Reactor *>(arg);
+            if (uv_is_closing(h) || h == reinterpret_cast<uv_handle_t *>(&r->post_async)) {
+                return;
+            }
+            if (h->type == UV_TIMER && uv_is_active(h)
+                && uv_timer_get_repeat(reinterpret_cast<uv_timer_t *>(h)) == 0) {
+                // a suspended request waits for it
+                return;
+            }
+            if (h->type == UV_TCP) {
+                auto twos = reinterpret_cast<two *>(h->data);
+                uv_read_stop(reinterpret_cast<ust *>(h));
+                twos->closeWhenIdle = true;
+                twos->paused = false;
+                pump(twos);
+            } else if (h->type != UV_POLL) {
+                // poll handles belong to file sends, which close them
+                uv_close(h, nullptr);
+            }
+        },
+        &r);
+    debug(fmt::format("whs: libuv worker {} draining.", r.index));
 }
 
 bool uv::stop()
 {
-    if (!externalLoop) {
-        uv_async_send(stop_async);
+    if (externalLoop == nullptr && reactors != nullptr) {
+        for (unsigned int i = 0; i < workers; i++) {
+            uv_async_send(&reactors[i].stop_async);
+        }
     }
     return true;
 }
 
 bool uv::_start()
 {
-    if (!externalLoop) {
+    if (externalLoop == nullptr) {
         debug("whs: libuv backend start.");
-        uv_run(loop, UV_RUN_DEFAULT);
-        m->lock();
-        m->unlock();
+        for (unsigned int i = 1; i < workers; i++) {
+            uv_thread_create(
+                &reactors[i].thread,
+                [](void *arg) { utils::run(reinterpret_cast<utils::Reactor *>(arg)); },
+                &reactors[i]);
+        }
+        utils::run(&reactors[0]);
+        for (unsigned int i = 1; i < workers; i++) {
+            uv_thread_join(&reactors[i].thread);
+        }
+        for (unsigned int i = 0; i < workers; i++) {
+            uv_loop_close(reactors[i].loop);
+        }
+        info("whs: libuv backend stopped.");
     }
     return true;
 }
 
-uv::LibuvWhs(std::string &&host, uint16_t port, uv_loop_s *l) : TcpWhs(host, port)
+uv::LibuvWhs(std::string &&host, uint16_t port, uv_loop_s *l)
+    : TcpWhs(host, port),
+      readBufferSizes(std::begin(whsutils::BufferPool::defaultSizes),
+                      std::end(whsutils::BufferPool::defaultSizes))
+{
+    reactors = nullptr;
+    workers = 1;
+    externalLoop = l;
+    deferredDepth = 128;
+    connectionPoolSize = 64;
+}
+
+uv::LibuvWhs(std::string &&host, uint16_t port) : LibuvWhs(std::move(host), port, nullptr) {}
+
+uv::~LibuvWhs()
+{
+    if (reactors != nullptr) {
+        if (externalLoop == nullptr) {
+            for (unsigned int i = 0; i < workers; i++) {
+                delete reactors[i].loop;
+            }
+        }
+        for (unsigned int i = 0; i < workers; i++) {
+            delete reactors[i].pool;
+            while (auto w = reactors[i].freeWrites) {
+                reactors[i].freeWrites = w->next;
+                delete w;
+            }
+            while (auto twos = reactors[i].freeConnections) {
+                reactors[i].freeConnections = twos->next;
+                deleteConnection(twos);
+            }
+        }
+        delete[] reactors;
+    }
+}
+
+utils::Reactor *uv::current()
 {
-    loop = l;
-    server = new uv_tcp_s;
-    stop_async = new uv_async_t;
-    stop_async->data = this;
-    server->data = this;
-    m = new utils::mutex;
-    externalLoop = true;
+    return utils::currentReactor;
 }
 
-uv::LibuvWhs(std::string &&host, uint16_t port) : LibuvWhs(std::move(host), port, new uv_loop_s)
+uv_loop_s *uv::loop(utils::Reactor *r)
 {
-    externalLoop = false;
+    return r->loop;
 }
 
-uv::~LibuvWhs()
+void uv::expect(utils::Reactor *r)
 {
-    delete m;
-    delete stop_async;
-    delete server;
-    if (!externalLoop) {
-        delete loop;
+    if (r->expected++ == 0) {
+        uv_ref(reinterpret_cast<uv_handle_t *>(&r->post_async));
     }
 }
 
-using thr = std::tuple<Client *, uv_buf_t *>;
+void uv::post(utils::Reactor *r, utils::Posted *p)
+{
+    p->next = r->posted.load(std::memory_order_relaxed);
+    while (!r->posted.compare_exchange_weak(
+        p->next, p, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    uv_async_send(&r->post_async);
+}
+
+void uv::setWorkerCount(unsigned int count)
+{
+    assert(reactors == nullptr);
+    if (count == 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers = count;
+}
+
+void uv::setReadBufferSizes(const std::vector<size_t> &sizes)
+{
+    assert(reactors == nullptr);
+    assert(!sizes.empty() && std::is_sorted(sizes.begin(), sizes.end()));
+    readBufferSizes = sizes;
+}
+
+BufferPoolStats uv::getReadBufferStats() const
+{
+    BufferPoolStats ret = {0, 0, 0, 0};
+    for (unsigned int i = 0; reactors != nullptr && i < workers; i++) {
+        auto s = reactors[i].pool->stats();
+        ret.mallocs += s.mallocs;
+        ret.hits += s.hits;
+        ret.frees += s.frees;
+        ret.inUse += s.inUse;
+    }
+    return ret;
+}
+
+void uv::setDeferredQueueDepth(size_t depth)
+{
+    assert(reactors == nullptr);
+    deferredDepth = depth;
+}
+
+DeferredStats uv::getDeferredStats() const
+{
+    DeferredStats ret = {0, 0, 0, 0};
+    for (unsigned int i = 0; reactors != nullptr && i < workers; i++) {
+        const auto &s = reactors[i].deferred;
+        ret.queued += s.queued;
+        ret.inlined += s.inlined;
+        ret.pending += s.pending;
+        ret.peak = std::max(ret.peak, s.peak);
+    }
+    return ret;
+}
+
+void uv::setConnectionPoolSize(size_t size)
+{
+    assert(reactors == nullptr);
+    connectionPoolSize = size;
+}
+
+ConnectionPoolStats uv::getConnectionPoolStats() const
+{
+    ConnectionPoolStats ret = {0, 0, 0, 0, 0};
+    for (unsigned int i = 0; reactors != nullptr && i < workers; i++) {
+        const auto &s = reactors[i].connections;
+        ret.growths += s.growths;
+        ret.hits += s.hits;
+        ret.frees += s.frees;
+        ret.inUse += s.inUse;
+        ret.trims += s.trims;
+    }
+    return ret;
+}
 
 void uv::write(Client *c, char *buf, size_t size)
 {
     auto twos = reinterpret_cast<two *>(c->get_data());
-    auto tcp = twos->tcp;
-    auto w = new uv_write_t;
-    auto uvbuf = new uv_buf_t;
-    uvbuf->base = buf;
-    uvbuf->len = size;
-    auto b = new thr;
-    auto pair = std::make_tuple(c, uvbuf);
-    b->swap(pair);
-    w->data = b;
-    uv_write(w, reinterpret_cast<ust *>(tcp), uvbuf, 1, [](uv_write_t *req, int) {
-        auto d = reinterpret_cast<thr *>(req->data);
-        thr tmp;
-        d->swap(tmp);
-        auto c = std::get<0>(tmp);
-        auto buf = std::get<1>(tmp);
-        delete[] buf->base;
-        delete buf;
-        delete req;
+    auto w = acquireWrite(twos->reactor, c);
+    w->chunks.push_back({buf, size, releaseArray, nullptr});
+    send(w);
+}
+
+void uv::write(Client *c, Response &resp)
+{
+    auto twos = reinterpret_cast<two *>(c->get_data());
+    auto w = acquireWrite(twos->reactor, c);
+    if (resp.isDeferred() && queue(w, resp)) {
+        // in the queue right away, so that the responses of the connection stay in order
+        send(w);
+        return;
+    }
+    if (auto d = resp.takeDeferred()) {
+        ++twos->reactor->deferred.inlined;
+        d->run();
+        d->complete(resp);
         delete d;
-        if (c->connection_should_close()) {
-            auto twos = reinterpret_cast<two *>(c->get_data());
-            auto tcp = twos->tcp;
-            auto shutdown = new uv_shutdown_t;
-            shutdown->data = tcp;
-            uv_shutdown(shutdown, reinterpret_cast<ust *>(tcp), [](uv_shutdown_t *shut, int) {
-                auto tcp = reinterpret_cast<uv_handle_t *>(shut->data);
-                uv_close(tcp, uvCloseCB);
-                delete shut;
-            });
+    }
+    fill(w, resp);
+    send(w);
+}
+
+void uv::resumed(Client *c, bool ok)
+{
+    auto twos = reinterpret_cast<two *>(c->get_data());
+    if (twos->closed) {
+        if (idle(twos)) {
+            freeConnection(twos);
         }
-    });
+        return;
+    }
+    if (!ok) {
+        warning("whs-uv: [read] bad request after a suspended one");
+        abortConnection(twos);
+        return;
+    }
+    if (twos->paused && !c->suspended()) {
+        twos->paused = false;
+        uv_read_start(reinterpret_cast<ust *>(twos->tcp), uvAllocCB, utils::uvReadCB);
+    }
+    // the connection may have to close now
+    pump(twos);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -5,15 +5,20 @@
 #include "config.h"
 
 #include "whs/whs.h"
+#include "whs/entity.h"
+#include "mime.h"
 
 #include <http_parser.h>
 #include <cstring>
 #include <cassert>
-#include <unordered_map>
-
-#ifndef UNIX_HAVE_PTHREAD_H
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <thread>
-#endif
+#include <unordered_map>
+#include <set>
+#include <sys/stat.h>
 
 #ifdef HAVE_LIBPCRE2
 #define PCRE2_CODE_UNIT_WIDTH 8
@@ -36,6 +41,9 @@ namespace whs
 
     class Pipeline final
     {
+        // runs before `wares', may be nullptr
+        const StaticStages *fused;
+        size_t fusedSize;
         Middleware **wares;
 
     public:
@@ -54,11 +62,30 @@ namespace whs
 
         inline bool feed(Request &req, Response &res) const THROWS
         {
+            for (size_t next = 0; next < fusedSize;) {
+                fused->feed(req, res, next);
+            }
             for (auto first = wares; *first != nullptr; ++first) {
                 (*first)->operator()(req, res);
             }
             return true;
         }
+
+        // run the middlewares from `next' on. false if one suspended the request, `next' is then
+        // the one after it. The stages of `fused' come first
+        inline bool feed(Request &req, Response &res, size_t &next) const THROWS
+        {
+            if (next < fusedSize && !fused->feed(req, res, next)) {
+                return false;
+            }
+            while (wares[next - fusedSize] != nullptr) {
+                wares[next++ - fusedSize]->operator()(req, res);
+                if (req.isSuspended()) {
+                    return false;
+                }
+            }
+            return true;
+        }
     };
 
     class HttpParserException : public HttpException
@@ -85,61 +112,104 @@ namespace whs
 
     namespace route
     {
-        struct HttpRouteNode {
-            HttpRouteNode **_children;
-            int _childrenCount;
-
-            HttpRouteNode()
-            {
-                _children = nullptr;
-                _childrenCount = 0;
-            }
-            virtual const MiddlewarePointer &getRoute(Request &,
-                                                      const char *,
-                                                      const char *) const THROWS = 0;
-
-            virtual ~HttpRouteNode();
-        };
-
-        struct HttpRouteStringNode : public HttpRouteNode {
-            const std::string _nodeName;
+        /**
+         * @brief routes of a HttpRouteBuilder compiled into a flat radix tree.
+         *
+         * A node either matches its static label byte by byte, or is a param node consuming one
+         * path segment. Children of a node are contiguous in `nodes': static children first, no
+         * two of them sharing a first byte, so at most one is entered, then param children in
+         * insertion order, tried until one leads to a handler. Handlers of a node are indexed by
+         * method through a bitmask, a method without handler is a miss like an unknown path.
+         */
+        class RadixTree
+        {
+        public:
+            static constexpr size_t MAX_PARAMS = 16;
+
+            struct Param {
+                std::string_view name;
+                const char *value;
+                size_t length;
+            };
+
+            using ParamList = Param[MAX_PARAMS];
+
+            class Compiler;
+
+        private:
+            struct Node {
+                uint32_t label;        // static label or param name, offset in `strings'
+                uint32_t labelLength;  //
+                uint32_t firstChild;
+                uint16_t staticCount;
+                uint16_t paramCount;
+                uint64_t methods;  // bit `m' set: handler of method `m' in `handlers'
+                uint32_t handler;  // index of the handler of the lowest method in `methods'
+                bool param;
+                bool trailingSlash;  // one extra '/' at the end of the URL is accepted
+                const utils::regex *constraint;  // param nodes only. nullptr: any segment
+            };
+
+            std::vector<Node> nodes;
+            std::string firstBytes;  // first byte of each static label, indexed as `nodes'
+            std::string strings;
+            std::vector<MiddlewarePointer> handlers;
+            std::vector<utils::regex *> regexes;
+
+            const MiddlewarePointer *match(const Node &,
+                                           const char *,
+                                           const char *,
+                                           int,
+                                           ParamList &,
+                                           size_t &) const;
 
-            HttpRouteStringNode(const std::string name) : _nodeName(name) {}
-            HttpRouteStringNode(const char *nn) : _nodeName(nn) {}
+        public:
+            RadixTree() = default;
+            RadixTree(const RadixTree &) = delete;
+            ~RadixTree();
 
-            virtual ~HttpRouteStringNode();
+            /**
+             * @brief find the handler of `method' for `url'.
+             * @param params receives the matched params, as spans of `url'
+             * @param count receives the count of matched params
+             * @return the handler, or nullptr when no route matches
+             */
+            const MiddlewarePointer *find(std::string_view url,
+                                          int method,
+                                          ParamList &params,
+                                          size_t &count) const;
 
-            virtual const MiddlewarePointer &getRoute(Request &,
-                                                      const char *,
-                                                      const char *) const THROWS override;
+            size_t size() const
+            {
+                return nodes.size();
+            }
         };
-        struct HttpRouteRootNode : public HttpRouteStringNode {
-            const MiddlewarePointer &GetRoute(Request &req, const std::string &url) const;
-
-            HttpRouteRootNode(const std::string & = std::string());
 
-            virtual const MiddlewarePointer &getRoute(Request &,
-                                                      const char *,
-                                                      const char *) const THROWS override;
-        };
         class HttpRouter : public Middleware
         {
             using iterator = std::vector<std::string>::const_iterator;
             using MP = Middleware *;
 
-            HttpRouteRootNode *start;
+            RadixTree *start;
 
             std::vector<MiddlewarePointer> middles;
 
-            bool GetRoute(Middleware &, Request &) const;
-
         public:
             static const MP emptyMiddleware;
 
-            const MiddlewarePointer &GetRoute(Request &req, const std::string &url) const
-            {
-                return start->GetRoute(req, url);
-            }
+            // what dispatch() did with a request
+            enum Result {
+                PASSED,     // the handler returned true
+                STOPPED,    // the handler returned false
+                NOT_FOUND,  // no route matches
+            };
+
+            /**
+             * @brief find the handler for `url' and the method of `req', and put matched params
+             * into `req'.
+             * @return the handler, or `emptyMiddleware' when no route matches
+             */
+            const MiddlewarePointer &GetRoute(Request &req, std::string_view url) const;
 
             virtual ~HttpRouter();
 
@@ -148,6 +218,18 @@ namespace whs
             HttpRouter();
             HttpRouter(HttpRouter &&);
             HttpRouter(HttpRouteBuilder &&b);
+
+            /**
+             * @brief run the handler of the route of `req'. A miss is a result, not an exception,
+             * since it is common (scanners, bots) and the server answers it with its NotFound
+             * handler anyway.
+             */
+            Result dispatch(Request &, Response &) const THROWS;
+
+            /**
+             * @brief as a middleware, a miss throws NotFoundException, or returns false without
+             * ENABLE_EXCEPTIONS.
+             */
             virtual bool operator()(Request &, Response &) const THROWS override;
         };
 
@@ -157,30 +239,10 @@ namespace whs
             const Request &_req;
 
         public:
-            NotFoundException(const Request &, const std::string &);
+            NotFoundException(const Request &, std::string_view);
             virtual bool buildResponse(char *&, size_t &) const override;
         };
 
-        using MP = Middleware *;
-
-        struct HttpRouteEndNode : public HttpRouteNode {
-            int method;
-            MP func;
-
-            virtual const MP &getRoute(Request &, const char *, const char *) const THROWS override;
-
-            HttpRouteEndNode(const MP &p) : func(p) {}
-        };
-
-        struct HttpRouteParamNode : public HttpRouteNode {
-            const std::string _paramName;
-            const utils::regex *_regex;
-
-            virtual ~HttpRouteParamNode();
-
-            HttpRouteParamNode(const std::string &pn, utils::regex &&regex);
-            virtual const MP &getRoute(Request &, const char *, const char *) const THROWS override;
-        };
     }  // namespace route
 
     namespace utils
@@ -190,11 +252,65 @@ namespace whs
             return s.find_first_of('{') == 0 && s.find_last_of('}') == s.length() - 1;
         }
 
+        // length of an IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+        constexpr size_t DATE_LENGTH = 29;
+
         void format_time(std::string &);
         void format_time(const struct tm *tm, std::string &);
+        // writes exactly DATE_LENGTH bytes, not NUL-terminated
+        void format_time(const struct tm *tm, char *out);
 
         bool parseParam(const std::string &, std::string &, regex &);
-        bool parseQueryString(const std::string &, std::map<std::string, std::string> &);
+        /**
+         * @brief split an URL query string (without '?') into percent-decoded name-value pairs.
+         * A name without '=' gets an empty value, empty names are skipped, and the first of
+         * repeated names wins.
+         * @param out arena receiving the decoded bytes of components containing '%' or '+'
+         * @param pairs pairs are appended here, pointing into `query' or `out'
+         */
+        void parseQueryString(std::string_view query,
+                              arena &out,
+                              std::vector<std::pair<std::string_view, std::string_view>> &pairs);
+
+        // `query' may start with '?'. false if no pair was found
+        bool parseQueryString(const std::string &query, std::map<std::string, std::string> &dict);
+
+        // bytes `first' to `last' of a body, both included
+        struct ByteRange {
+            uint64_t first;
+            uint64_t last;
+        };
+
+        enum class RangeResult { Ignore, Unsatisfiable, Satisfiable };
+
+        // more ranges than this are taken as an abuse: the header is ignored
+        constexpr size_t MAX_RANGES = 16;
+
+        /**
+         * @brief parse the value of a Range header for a body of `size' bytes.
+         * @param ranges receives the satisfiable ranges, clipped to the body, in request order
+         * @return Ignore if the value is malformed, not in bytes, or has too many ranges: the
+         * whole body is sent. Unsatisfiable if no range overlaps the body
+         */
+        RangeResult parseRanges(std::string_view value,
+                                uint64_t size,
+                                std::vector<ByteRange> &ranges);
+
+        /**
+         * @brief whether the value of an If-None-Match header matches `etag', a quoted strong
+         * entity-tag: `*', or a comma separated list holding it, compared weakly (W/"x" matches
+         * "x"). If-Range takes the strong comparison instead, plain equality with `etag'
+         */
+        bool noneMatchHits(std::string_view value, std::string_view etag);
+
+        /**
+         * @brief choose a content coding with the value of an Accept-Encoding header.
+         * @param codings the candidates, in order of preference between equal q-values
+         * @return index of the chosen one in `codings', -1 if none is acceptable: identity
+         */
+        int negotiateEncoding(std::string_view accept,
+                              const std::string_view *codings,
+                              size_t count);
 
         inline char *dup_memory(const void *buffer, size_t size)
         {
@@ -236,36 +352,447 @@ namespace whs
              */
             void unlock();
         };
+
+        /**
+         * @brief Xxh64: XXH64, the 64-bit xxHash, of a stream of bytes.
+         */
+        class Xxh64
+        {
+            uint64_t acc[4];
+            uint64_t total;
+            uint64_t seed;
+            unsigned char buffered[32];  // an incomplete stripe
+            size_t bufferedSize;
+
+        public:
+            explicit Xxh64(uint64_t seed = 0);
+
+            void update(const void *, size_t);
+
+            // hash of the bytes so far, more may be added after
+            uint64_t digest() const;
+        };
+
+        /**
+         * @brief Published: an immutable T read without locks while one writer replaces it.
+         *
+         * RCU-style: a reader announces itself in a counter of the current phase, then loads the
+         * pointer. The writer swaps the pointer and flips the phase twice, each time waiting
+         * until the counters of the phase left drain; after that no reader can hold the old T.
+         * New readers count in the other phase, so a steady stream of them does not starve the
+         * writer. Counters are spread over cache lines by thread.
+         */
+        template <class T>
+        class Published : noncopyable
+        {
+            static constexpr size_t shards = 16;
+            struct alignas(64) Counter {
+                std::atomic<size_t> n{0};
+            };
+
+            std::atomic<const T *> current;
+            std::atomic<size_t> phase;
+            mutable Counter readers[2][shards];
+
+            static size_t shard()
+            {
+                static std::atomic<size_t> next{0};
+                thread_local size_t s = next.fetch_add(1, std::memory_order_relaxed) % shards;
+                return s;
+            }
+
+            void drain(size_t p) const
+            {
+                for (auto &c : readers[p & 1]) {
+                    // readers are short, but one may have been preempted
+                    for (int spins = 0; c.n.load() != 0; ++spins) {
+                        if (spins < 64) {
+                            std::this_thread::yield();
+                        } else {
+                            std::this_thread::sleep_for(std::chrono::microseconds(50));
+                        }
+                    }
+                }
+            }
+
+        public:
+            // keeps the T it was created with alive, hold it briefly
+            class Reader : noncopyable
+            {
+                std::atomic<size_t> &counter;
+                const T *value;
+
+            public:
+                explicit Reader(const Published &p)
+                    : counter(p.readers[p.phase.load() & 1][shard()].n)
+                {
+                    counter.fetch_add(1);
+                    value = p.current.load();
+                }
+
+                ~Reader()
+                {
+                    counter.fetch_sub(1, std::memory_order_release);
+                }
+
+                const T &operator*() const
+                {
+                    return *value;
+                }
+
+                const T *operator->() const
+                {
+                    return value;
+                }
+            };
+
+            explicit Published(const T *initial = new T) : current(initial), phase(0) {}
+
+            ~Published()
+            {
+                delete current.load();
+            }
+
+            Reader read() const
+            {
+                return Reader(*this);
+            }
+
+            // replace the T by `next' and free the old one once no reader holds it. One writer
+            // at a time
+            void publish(const T *next)
+            {
+                auto old = current.exchange(next);
+                drain(phase.fetch_add(1));
+                drain(phase.fetch_add(1));
+                delete old;
+            }
+        };
+
+        /**
+         * @brief FileCache: bodies of small files kept in memory, within a byte budget.
+         *
+         * Entries are reference counted: a response holds its entry until the body is sent, so
+         * evicting or invalidating an entry never frees bytes still being written. Eviction is
+         * CLOCK: a hit sets the entry's reference bit, the hand clears it and drops entries hit
+         * since its previous pass.
+         *
+         * A hit takes no lock: it looks the key up in a snapshot of the map. Invalidations are
+         * published at once, fills and evictions once they reach an eighth of the entries, so
+         * warming the cache copies the map O(1) times per file. A fill not published yet is
+         * published by the next fill of its key, which a miss on it makes. The mutex only orders
+         * the writers and is released before waiting for lookups to leave the old snapshot; an
+         * entry dropped from the map is released once none can still see it.
+         */
+        class FileCache : noncopyable
+        {
+        public:
+            struct Entry {
+                std::atomic<uint32_t> refs;
+                uint64_t key;
+                size_t slot;                   // in the clock, guarded by the cache mutex
+                std::atomic<bool> referenced;  // hit since the hand passed
+                std::string_view head;         // pre-serialized header lines
+                std::string_view body;
+            };
+
+        private:
+            using Map = std::unordered_map<uint64_t, Entry *>;
+            static constexpr size_t shards = 16;
+            struct alignas(64) Lookups {
+                std::atomic<size_t> hits{0};
+                std::atomic<size_t> misses{0};
+            };
+
+            mutable mutex m;
+            Map entries;                   // the writers' copy
+            Published<Map> published;      // what get looks in
+            std::vector<Entry *> retired;  // dropped, released by the next commit
+            size_t pending;                // changes to `entries' not published
+            uint64_t snapshots;            // copies of `entries' made
+            mutex publishing;              // orders the commits, held while lookups drain
+            uint64_t newest;               // the snapshot published, guarded by `publishing'
+            std::vector<Entry *> clock;    // nullptr: free slot
+            std::vector<size_t> freeSlots;
+            size_t hand;
+
+            size_t budget;
+            size_t maxFileSize;
+            size_t bytes;
+
+            // bumped by every invalidation, see put
+            std::atomic<uint64_t> epoch;
+            FileCacheStats counters;  // but hits and misses, counted by thread in lookups
+            Lookups lookups[shards];
+
+            void drop(Entry *);
+            void commit(std::unique_lock<mutex> &);
+            bool makeRoom(size_t);
+
+        public:
+            static constexpr size_t defaultBudget = 64 << 20;
+            static constexpr size_t defaultMaxFileSize = 256 << 10;
+
+            FileCache(size_t budget = defaultBudget, size_t maxFileSize = defaultMaxFileSize);
+            ~FileCache();
+
+            // drops everything. 0 disables the cache
+            void configure(size_t budget, size_t maxFileSize);
+
+            // whether a file of `size' bytes may be cached
+            bool cacheable(size_t size) const
+            {
+                return size <= maxFileSize && size <= budget;
+            }
+
+            uint64_t currentEpoch() const
+            {
+                return epoch.load(std::memory_order_acquire);
+            }
+
+            // referenced entry of `key', nullptr if not cached. Counts a hit or a miss
+            Entry *get(uint64_t key);
+
+            /**
+             * @brief read `size' bytes of `fd' into a new entry, cached under `key' unless an
+             * invalidation happened since `since' (from currentEpoch() before opening the file).
+             * @return the entry, referenced. nullptr if the file could not be read
+             */
+            Entry *put(uint64_t key, std::string_view head, int fd, size_t size, uint64_t since);
+
+            void invalidate(uint64_t key);
+            // all of `keys', published once
+            void invalidate(const std::vector<uint64_t> &keys);
+
+            // one more reference to an entry already referenced
+            static Entry *retain(Entry *e)
+            {
+                e->refs.fetch_add(1, std::memory_order_relaxed);
+                return e;
+            }
+
+            static void release(Entry *);
+
+            FileCacheStats stats() const;
+        };
+
+#ifdef ENABLE_LIBUV
+        /**
+         * @brief WorkerPool: threads running jobs handed over by the event loops.
+         *
+         * Every worker has its own queue, jobs are spread over them round robin. A worker whose
+         * queue is empty steals from the others before it sleeps, so one long job does not hold
+         * back the jobs queued behind it.
+         */
+        class WorkerPool : noncopyable
+        {
+            struct Queue {
+                mutex m;
+                Posted *head = nullptr;
+                Posted *tail = nullptr;
+            };
+
+            std::vector<std::thread> threads;
+            std::unique_ptr<Queue[]> queues;
+            std::atomic<size_t> next;    // queue of the next job
+            std::atomic<size_t> queued;  // jobs in the queues
+
+            mutex idle;
+            std::condition_variable_any wake;
+            std::atomic<size_t> sleeping;
+            bool stopping;
+
+            // from the queue of `self' first, then from the others. nullptr if all are empty
+            Posted *take(size_t self);
+
+            void work(size_t self);
+
+        public:
+            explicit WorkerPool(size_t count);
+
+            // runs the jobs still queued first
+            ~WorkerPool();
+
+            // have `job->run(job)' called on a worker
+            void submit(Posted *job);
+
+            size_t size() const
+            {
+                return threads.size();
+            }
+
+            // the pool of offloaded handlers, started by the first call
+            static WorkerPool &shared();
+
+            // thread count of shared(), taken by its first call. 0: one per CPU
+            static std::atomic<unsigned int> sharedSize;
+        };
+#endif
     }  // namespace utils
 
     class StaticFileServer : public Middleware
     {
-        static constexpr uint8_t MD5_DIGEST_LENGTH = 16;
-        static constexpr uint8_t ETAG_LENGTH = 32;
+        // 16 hex digits, quoted
+        static constexpr uint8_t ETAG_LENGTH = 18;
+        // precompressed siblings: foo.js.br, foo.js.zst, foo.js.gz
+        static constexpr size_t ENCODINGS = 3;
+        // what identifies the content of a file in the on-disk ETag index
+        struct stamp {
+            uint64_t inode;
+            uint64_t size;
+            int64_t mtime;  // ns
+
+            bool operator==(const stamp &o) const
+            {
+                return inode == o.inode && size == o.size && mtime == o.mtime;
+            }
+        };
+        struct stamp_hash {
+            size_t operator()(const stamp &s) const
+            {
+                return std::hash<uint64_t>{}(s.inode ^ (s.size << 32) ^ s.mtime);
+            }
+        };
+
+    public:
         struct file {
             static uint32_t major_time;
-            const char *mime;
-            uint32_t size;
+            std::string_view mime;
+            uint64_t size;
+            uint32_t last_save_time;
+            stamp id;
+            uint64_t hash;  // XXH64 of the content
+
+            explicit file(std::string_view mime);
+            void set_stat(const struct stat &);
+            // hash the content of the file at `name', and take its stat. false if unreadable
+            bool hash_content(const std::string &name, std::vector<char> &buf);
+        };
+        // a file as requests see it
+        struct indexed {
+            std::string_view path;  // relative, interned in the index
+            std::string_view mime;
+            uint64_t key;   // hash of `path', the cache key
+            uint64_t hash;  // of the content, the ETag
+            uint64_t size;
             uint32_t last_save_time;
-            char etag[ETAG_LENGTH + 1];
+            // position + 1 of each precompressed sibling in the index, 0 if there is none
+            uint32_t variants[ENCODINGS];
+            // another path has the same `key', the cache can not tell them apart
+            bool shared;
 
             time_t get_save_time() const
             {
-                time_t ret = major_time;
+                time_t ret = file::major_time;
                 return ret << 32 | last_save_time;
             }
-            file(const std::string &);
-            void calc_etag(const std::string &);
+            // the ETag, quoted. It only depends on the bytes: restarts and replicas agree on it
+            void etag(char (&out)[ETAG_LENGTH + 1]) const;
+        };
+        /**
+         * @brief files by path: linear probing over slots of 8 bytes, a hit compares the path.
+         *
+         * Paths are copied into one arena and entries stored in one vector, so a lookup touches
+         * one slot cache line in most cases, and the entry it ends at.
+         */
+        class Index : utils::noncopyable
+        {
+            struct slot {
+                uint32_t tag;    // high half of the key
+                uint32_t entry;  // position + 1, 0 if free
+            };
+            utils::arena paths;
+            std::vector<indexed> entries;
+            std::vector<slot> slots;  // a power of two in size, at most half used
+
+        public:
+            // room for `count' files
+            explicit Index(size_t count = 0);
+
+            // `name' must not be in yet. Variants are set once all files are added
+            indexed &add(std::string_view name, const file &);
+
+            const indexed *find(std::string_view name, uint64_t key) const;
+            const indexed *find(std::string_view name) const
+            {
+                return find(name, std::hash<std::string_view>{}(name));
+            }
+
+            // the precompressed sibling `i' of `f', nullptr if there is none
+            const indexed *variant(const indexed &f, size_t i) const
+            {
+                return f.variants[i] != 0 ? &entries[f.variants[i] - 1] : nullptr;
+            }
+
+            std::vector<indexed>::iterator begin()
+            {
+                return entries.begin();
+            }
+            std::vector<indexed>::iterator end()
+            {
+                return entries.end();
+            }
+            uint32_t position(const indexed &f) const
+            {
+                return &f - entries.data();
+            }
         };
+
+    private:
+
         int fd;
         utils::mutex m;
 
         std::string path;
         std::string prefix;
-        void start_thread();
 
-        void list_files();
-        std::unordered_map<uint64_t, file> files;
+        // reads `fd' until stop() writes to `stopFd'
+        std::thread watcher;
+        int stopFd;
+        void start_thread();
+        void watch();
+
+        mutable utils::FileCache cache;
+
+        // Content-Type of files by extension, only changed before start()
+        mime::Table types;
+
+        // owned by the watcher once started: files by path relative to `path', and watched
+        // directories by watch descriptor, "" for `path' itself, others ending with '/'
+        std::map<std::string, file> files;
+        std::unordered_map<int, std::string> dirs;
+        // files to stat again, and hashes of the paths changed since the last flush()
+        std::set<std::string> pending;
+        std::vector<uint64_t> changed;
+        // what requests look up: the entries of `files' in an Index, their precompressed siblings
+        // linked. Rebuilt and published by each flush()
+        utils::Published<Index> index;
+
+        // see Whs::setStaticFileEtagIndex. Hashes from it are trusted by the first flush() only,
+        // later ones follow events telling the content changed
+        std::string etagIndex;
+        std::unordered_map<stamp, uint64_t, stamp_hash> knownHashes;
+        void load_etags();
+        void save_etags() const;
+
+        // what answering a GET or HEAD of a found file takes
+        struct reply;
+        class Read;
+        std::string cachedHead(const reply &) const;
+        // the response to `r', `size' bytes from the cached entry `e' if not nullptr, else from
+        // the file `rd' if not -1. Takes `e' and `rd'
+        void respond(const reply &r,
+                     Response &,
+                     utils::FileCache::Entry *e,
+                     int rd,
+                     size_t size) const;
+
+        bool watch_tree(const std::string &);
+        void remove_tree(const std::string &);
+        void track(const std::string &, const file &);
+        void untrack(const std::string &);
+        void touch(const std::string &);
+        void flush();
 
     public:
         StaticFileServer(StaticFileServer &&);
@@ -275,6 +802,26 @@ namespace whs
         bool start();
         void stop();
 
+        // see Whs::setStaticFileCache
+        void setCache(size_t budget, size_t maxFileSize)
+        {
+            cache.configure(budget, maxFileSize);
+        }
+
+        FileCacheStats getCacheStats() const
+        {
+            return cache.stats();
+        }
+
+        // see Whs::setStaticFileEtagIndex
+        bool setEtagIndex(const std::string &);
+
+        // see Whs::setStaticFileMimeTypes
+        bool setMimeTypes(const std::string &file)
+        {
+            return types.load(file);
+        }
+
         virtual bool operator()(Request &, Response &) const THROWS override;
     };
 }  // namespace whs
@@ -19,23 +19,46 @@ namespace
     /**
      * @brief MergeDefaultCommonHeaders: merge some common headers shared between requests
      *
+     * The constant headers are serialized once, when the server starts, and the Date line comes
+     * from the per-thread DateCache, so a response usually gets them as two raw header blocks.
      */
     class MergeDefaultCommonHeaders : public Middleware
     {
-    public:
-        virtual bool operator()(Request&, Response& res) const THROWS override
-        {
-            using std::to_string;
+        static constexpr char server[] = "whs/" WHS_VERSION;
 
-            std::string now;
-            wu::format_time(now);
-            static constexpr char server[] = "whs/" WHS_VERSION;
+        // Server and X-Powered-By, with and without Cache-Control
+        std::string constant;
+        std::string constantNoStore;
 
-            res.addHeader(wu::CommonHeader::Server, server);
-            res.addHeader(wu::CommonHeader::XPoweredBy, server);
+    public:
+        MergeDefaultCommonHeaders()
+        {
+            constant = fmt::format("{}: {}\r\n{}: {}\r\n",
+                                   wu::mapCommonHeader(wu::CommonHeader::Server),
+                                   server,
+                                   wu::mapCommonHeader(wu::CommonHeader::XPoweredBy),
+                                   server);
+            constantNoStore = fmt::format("{}{}: no-store\r\n",
+                                          constant,
+                                          wu::mapCommonHeader(wu::CommonHeader::CacheControl));
+        }
 
-            res.addHeaderIfNotExists(wu::CommonHeader::CacheControl, "no-store");
-            res.addHeader(wu::CommonHeader::Date, now);
+        virtual bool operator()(Request&, Response& res) const THROWS override
+        {
+            if (res.hasHeader(wu::CommonHeader::Server)
+                || res.hasHeader(wu::CommonHeader::XPoweredBy)) {
+                // the handler set its own value, which wins
+                res.addHeader(wu::CommonHeader::Server, server);
+                res.addHeader(wu::CommonHeader::XPoweredBy, server);
+                res.addHeaderIfNotExists(wu::CommonHeader::CacheControl, "no-store");
+            } else if (res.hasHeader(wu::CommonHeader::CacheControl)) {
+                res.addRawHeaders(constant);
+            } else {
+                res.addRawHeaders(constantNoStore);
+            }
+            if (!res.hasHeader(wu::CommonHeader::Date)) {
+                res.addRawHeaders(whsutils::DateCache::local().line());
+            }
             return true;
         }
     };
@@ -57,7 +80,6 @@ namespace
             return true;
         }
     };
-#ifdef ENABLE_EXCEPTIONS
     class SystemErrorHandler : public Middleware
     {
     public:
@@ -70,7 +92,6 @@ namespace
             return true;
         }
     };
-#endif
 }  // namespace
 
 Whs::~Whs()
@@ -115,20 +136,30 @@ void Whs::setup()
     this->init();
 }
 
-void Whs::processing_request(RestfulHttpRequest& req, RestfulHttpResponse& resp)
+bool Whs::processing_request(Request& req, Response& resp, Progress& at)
 {
     try {
-        auto status = before->feed(req, resp);
-        if (!resp.isEnded()) {
-            try {
-                if (status) {
-                    route->operator()(req, resp);
+        if (at.stage == Progress::BEFORE) {
+            if (!before->feed(req, resp, at.index)) {
+                return false;
+            }
+            at = {Progress::ROUTE, 0};
+        }
+        if (at.stage == Progress::ROUTE) {
+            // a handler suspending resumes with the after pipeline
+            at = {Progress::AFTER, 0};
+            if (!resp.isEnded()) {
+                if (route->dispatch(req, resp) == route::HttpRouter::NOT_FOUND) {
+                    notFound->operator()(req, resp);
+                }
+                if (req.isSuspended()) {
+                    return false;
                 }
-            } catch (const route::NotFoundException& e) {
-                notFound->operator()(req, resp);
             }
         }
-        after->feed(req, resp);
+        if (at.stage == Progress::AFTER && !after->feed(req, resp, at.index)) {
+            return false;
+        }
     } catch (const HttpException& he) {
         char* buf;
         size_t size;
@@ -136,8 +167,13 @@ void Whs::processing_request(RestfulHttpRequest& req, RestfulHttpResponse& resp)
         resp.setBody(buf, size);
         resp.status(he.getStatusCode());
     }
+    // a stage which suspended, then threw, still has to resume before the error is sent
+    at.stage = Progress::DONE;
+    return !req.isSuspended();
 }
 
+void Whs::resumed(Client*, bool) {}
+
 bool Whs::start()
 {
     if (notFound == nullptr) {
@@ -170,6 +206,39 @@ bool Whs::enable_static_file(const std::string& prefix, const std::string& local
     return true;
 }
 
+bool Whs::setStaticFileCache(size_t budget, size_t maxFileSize)
+{
+    if (staticFile == nullptr) {
+        return false;
+    }
+    reinterpret_cast<StaticFileServer*>(staticFile)->setCache(budget, maxFileSize);
+    return true;
+}
+
+bool Whs::setStaticFileEtagIndex(const std::string& file)
+{
+    if (staticFile == nullptr) {
+        return false;
+    }
+    return reinterpret_cast<StaticFileServer*>(staticFile)->setEtagIndex(file);
+}
+
+bool Whs::setStaticFileMimeTypes(const std::string& file)
+{
+    if (staticFile == nullptr) {
+        return false;
+    }
+    return reinterpret_cast<StaticFileServer*>(staticFile)->setMimeTypes(file);
+}
+
+FileCacheStats Whs::getStaticFileCacheStats() const
+{
+    if (staticFile == nullptr) {
+        return {0, 0, 0, 0, 0, 0};
+    }
+    return reinterpret_cast<const StaticFileServer*>(staticFile)->getCacheStats();
+}
+
 RawWhs::RawWhs()
 {
     auto mb = new whsutils::MemoryBuffer();
@@ -183,6 +252,20 @@ RawWhs::~RawWhs()
     delete c;
 }
 
+void Whs::write(Client* c, Response& resp)
+{
+    if (auto d = resp.takeDeferred()) {
+        // no I/O threads: the blocking part runs right here
+        d->run();
+        d->complete(resp);
+        delete d;
+    }
+    char* buf;
+    size_t size;
+    resp.toBytes(&buf, size);
+    write(c, buf, size);
+}
+
 void RawWhs::write(Client*, char* buf, size_t s)
 {
     auto mb = reinterpret_cast<whsutils::MemoryBuffer*>(c->get_data());
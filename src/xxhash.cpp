@@ -0,0 +1,126 @@
+#include "whs-internal.h"
+
+using whs::utils::Xxh64;
+
+// XXH64, as specified in https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+namespace
+{
+    constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr uint64_t prime3 = 0x165667B19E3779F9ULL;
+    constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+    inline uint64_t rotl(uint64_t x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t read64(const unsigned char *p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;  // little endian hosts only, as the rest of the server
+    }
+
+    inline uint32_t read32(const unsigned char *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint64_t step(uint64_t acc, uint64_t lane)
+    {
+        acc += lane * prime2;
+        acc = rotl(acc, 31);
+        return acc * prime1;
+    }
+
+    inline uint64_t merge(uint64_t acc, uint64_t v)
+    {
+        acc ^= step(0, v);
+        return acc * prime1 + prime4;
+    }
+
+    // consume whole stripes of 32 bytes, returns the end of the last one
+    const unsigned char *stripes(uint64_t *acc, const unsigned char *p, const unsigned char *end)
+    {
+        for (; end - p >= 32; p += 32) {
+            acc[0] = step(acc[0], read64(p));
+            acc[1] = step(acc[1], read64(p + 8));
+            acc[2] = step(acc[2], read64(p + 16));
+            acc[3] = step(acc[3], read64(p + 24));
+        }
+        return p;
+    }
+}  // namespace
+
+Xxh64::Xxh64(uint64_t seed) : total(0), seed(seed), bufferedSize(0)
+{
+    acc[0] = seed + prime1 + prime2;
+    acc[1] = seed + prime2;
+    acc[2] = seed;
+    acc[3] = seed - prime1;
+}
+
+void Xxh64::update(const void *data, size_t size)
+{
+    auto p = static_cast<const unsigned char *>(data);
+    auto end = p + size;
+    total += size;
+
+    if (bufferedSize + size < sizeof(buffered)) {
+        memcpy(buffered + bufferedSize, p, size);
+        bufferedSize += size;
+        return;
+    }
+    if (bufferedSize != 0) {
+        auto fill = sizeof(buffered) - bufferedSize;
+        memcpy(buffered + bufferedSize, p, fill);
+        stripes(acc, buffered, buffered + sizeof(buffered));
+        p += fill;
+        bufferedSize = 0;
+    }
+    p = stripes(acc, p, end);
+    memcpy(buffered, p, end - p);
+    bufferedSize = end - p;
+}
+
+uint64_t Xxh64::digest() const
+{
+    uint64_t h;
+    if (total >= 32) {
+        h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+        for (auto a : acc) {
+            h = merge(h, a);
+        }
+    } else {
+        h = seed + prime5;
+    }
+    h += total;
+
+    auto p = buffered;
+    auto end = buffered + bufferedSize;
+    for (; end - p >= 8; p += 8) {
+        h ^= step(0, read64(p));
+        h = rotl(h, 27) * prime1 + prime4;
+    }
+    if (end - p >= 4) {
+        h ^= read32(p) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * prime5;
+        h = rotl(h, 11) * prime1;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}